@@ -0,0 +1,642 @@
+//
+// Copyright(C) 2022-2024 Simon Howard
+//
+// You can redistribute and/or modify this program under the terms of
+// the GNU General Public License version 2 as published by the Free
+// Software Foundation, or any later version. This program is
+// distributed WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+
+// wadbench times common operations on WAD files, for comparing changes
+// to the I/O code. Build it with "make wadbench" and run eg.
+//
+//   ./wadbench -n 2000 -s 8000,10,20000 open import
+//
+// -n sets the number of lumps in the test WAD (default 500), and -s
+// simulates slow storage with "seek_usec,usec_per_kb[,sync_usec]" (see
+// vfsimulateslowio). If no benchmark names are given, all are run.
+
+#include <curses.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "conv/export.h"
+#include "conv/import.h"
+#include "fs/vfile.h"
+#include "fs/vfs.h"
+#include "fs/wad_file.h"
+#include "lump_info.h"
+#include "ui/pane.h"
+
+#define MAX_LUMP_SIZE  20000
+#define COPY_SIZE      (10 * 1000 * 1000)
+
+struct benchmark {
+	const char *name;
+	void (*run)(void);
+};
+
+static char work_dir[] = "/tmp/wadbench.XXXXXX";
+static char **work_files;
+static size_t num_work_files;
+static char *test_wad;
+static unsigned int num_lumps = 500;
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void ReportTime(const char *what, double secs)
+{
+	printf("  %-36s %9.3fms\n", what, secs * 1000);
+}
+
+static void Report(const char *what, double start)
+{
+	ReportTime(what, Now() - start);
+}
+
+// Returns the path of a file in the working directory, which is deleted
+// at exit.
+static char *WorkPath(const char *name)
+{
+	char *result = checked_malloc(strlen(work_dir) + strlen(name) + 2);
+	sprintf(result, "%s/%s", work_dir, name);
+
+	work_files = checked_realloc(work_files,
+	                             (num_work_files + 1) * sizeof(char *));
+	work_files[num_work_files] = checked_strdup(result);
+	++num_work_files;
+
+	return result;
+}
+
+static void RemoveWorkDir(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_work_files; i++) {
+		remove(work_files[i]);
+	}
+	rmdir(work_dir);
+}
+
+static void Fail(const char *msg)
+{
+	fprintf(stderr, "wadbench: %s\n", msg);
+	exit(1);
+}
+
+// Copies with plain stdio, so that the copy is never slowed down.
+static void CopyFile(const char *from, const char *to)
+{
+	FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+	char buf[4096];
+	size_t nbytes;
+
+	if (in == NULL || out == NULL) {
+		Fail("failed to copy test WAD");
+	}
+	while ((nbytes = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fwrite(buf, 1, nbytes, out);
+	}
+	fclose(in);
+	fclose(out);
+}
+
+// Long operations like compaction show progress windows, so curses needs
+// to be running, but nobody needs to see them.
+static void InitHiddenUI(void)
+{
+	FILE *null = fopen("/dev/null", "r+");
+
+	if (null == NULL || newterm("vt100", null, null) == NULL) {
+		Fail("failed to initialize curses");
+	}
+	UI_Init();
+}
+
+static void FillBuffer(uint8_t *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (seed * 31 + i * 7) & 0xff;
+	}
+}
+
+static void PutLong(FILE *fs, uint32_t val)
+{
+	uint8_t buf[4] = {val, val >> 8, val >> 16, val >> 24};
+	fwrite(buf, 1, 4, fs);
+}
+
+// Test WADs are written with plain stdio, so that making them is never
+// slowed down. Lump sizes are random up to max_size, and there is a hole
+// before every third lump like in a WAD that has been edited for a while.
+// Some lumps have the same contents, so there is something to dedupe.
+static void MakeTestWAD(const char *filename, unsigned int lumps,
+                        size_t max_size)
+{
+	static uint8_t buf[MAX_LUMP_SIZE];
+	uint32_t *positions, *sizes, dir_offset;
+	char name[16];
+	unsigned int i;
+	size_t len;
+	FILE *fs;
+
+	fs = fopen(filename, "wb");
+	if (fs == NULL) {
+		Fail("failed to create test WAD");
+	}
+	positions = checked_calloc(lumps, sizeof(uint32_t));
+	sizes = checked_calloc(lumps, sizeof(uint32_t));
+
+	fwrite("PWAD", 1, 4, fs);
+	PutLong(fs, lumps);
+	PutLong(fs, 0);
+	srand(1);
+	for (i = 0; i < lumps; i++) {
+		if ((i % 3) == 0) {
+			len = rand() % max_size;
+			FillBuffer(buf, len, i);
+			fwrite(buf, 1, len, fs);
+		}
+		positions[i] = ftell(fs);
+		sizes[i] = rand() % max_size;
+		FillBuffer(buf, sizes[i], i % 50);
+		fwrite(buf, 1, sizes[i], fs);
+	}
+
+	dir_offset = ftell(fs);
+	for (i = 0; i < lumps; i++) {
+		PutLong(fs, positions[i]);
+		PutLong(fs, sizes[i]);
+		snprintf(name, sizeof(name), "L%07u", i % 10000000);
+		fwrite(name, 1, 8, fs);
+	}
+	fseek(fs, 8, SEEK_SET);
+	PutLong(fs, dir_offset);
+
+	fclose(fs);
+	free(positions);
+	free(sizes);
+}
+
+// The test WAD for most benchmarks is only made when it is first needed.
+static const char *TestWAD(void)
+{
+	if (test_wad == NULL) {
+		test_wad = WorkPath("test.wad");
+		MakeTestWAD(test_wad, num_lumps, MAX_LUMP_SIZE);
+	}
+	return test_wad;
+}
+
+// Each benchmark gets its own copy of the test WAD.
+static char *CopyOfTestWAD(const char *name)
+{
+	char *result = WorkPath(name);
+	CopyFile(TestWAD(), result);
+	return result;
+}
+
+static void ReadAllHeaders(struct wad_file *wf)
+{
+	uint8_t header[8];
+	unsigned int i;
+
+	for (i = 0; i < W_NumLumps(wf); i++) {
+		W_ReadLumpHeader(wf, i, header, sizeof(header));
+	}
+}
+
+static void OpenBenchmark(void)
+{
+	const char *wad = TestWAD();
+	struct wad_file *wf;
+	double start;
+
+	start = Now();
+	wf = W_OpenFile(wad);
+	Report("W_OpenFile", start);
+	ReadAllHeaders(wf);
+	Report("W_OpenFile + all lump headers", start);
+	W_CloseFile(wf);
+}
+
+static void ExportBenchmark(void)
+{
+	struct directory *dir = VFS_OpenDir(TestWAD());
+	struct wad_file *wf = VFS_WadFile(dir);
+	char *filename, name[32];
+	unsigned int i, count = 0;
+	double start;
+
+	start = Now();
+	for (i = 0; i < dir->num_entries; i += 5) {
+		snprintf(name, sizeof(name), "export%u.lmp", i);
+		filename = WorkPath(name);
+		if (!ExportToFile(dir, &dir->entries[i],
+		                  LI_IdentifyLump(wf, i), filename, false)) {
+			Fail("export failed");
+		}
+		free(filename);
+		++count;
+	}
+	snprintf(name, sizeof(name), "export %u lumps", count);
+	Report(name, start);
+	VFS_CloseDir(dir);
+}
+
+// Imports a fifth of the lumps back from files, as a single commit like
+// the import action does.
+static void ImportBenchmark(void)
+{
+	static uint8_t buf[MAX_LUMP_SIZE];
+	char *wad = CopyOfTestWAD("import.wad");
+	struct directory *dir;
+	struct wad_file *wf;
+	unsigned int i, count = num_lumps / 5, lumpnum;
+	char *filename, name[32];
+	double start;
+	FILE *fs;
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "import%u.lmp", i);
+		filename = WorkPath(name);
+		fs = fopen(filename, "wb");
+		FillBuffer(buf, i * 97 % MAX_LUMP_SIZE, i);
+		fwrite(buf, 1, i * 97 % MAX_LUMP_SIZE, fs);
+		fclose(fs);
+		free(filename);
+	}
+
+	dir = VFS_OpenDir(wad);
+	wf = VFS_WadFile(dir);
+	start = Now();
+	lumpnum = W_NumLumps(wf);
+	W_AddEntries(wf, lumpnum, count);
+	for (i = 0; i < count; i++, lumpnum++) {
+		snprintf(name, sizeof(name), "import%u.lmp", i);
+		filename = WorkPath(name);
+		if (!ImportFromFile(vfwrapfile(fopen(filename, "rb")), name,
+		                    i * 97 % MAX_LUMP_SIZE, dir, lumpnum,
+		                    false)) {
+			Fail("import failed");
+		}
+		free(filename);
+	}
+	VFS_CommitChanges(dir, "import");
+	snprintf(name, sizeof(name), "import %u lumps + commit", count);
+	Report(name, start);
+	VFS_CloseDir(dir);
+	free(wad);
+}
+
+// ReadDirectory and WriteDirectory used to make three calls for each entry;
+// that is repeated here for comparison. The WAD has small lumps, so that
+// it can have many of them.
+static void DirectoryBenchmark(void)
+{
+	char *wad = WorkPath("directory.wad"), *out = WorkPath("directory.out");
+	struct wad_file_entry *dir;
+	uint32_t position, size, i;
+	struct wad_file *wf;
+	uint8_t header[12];
+	char name[8];
+	double start;
+	VFILE *vf;
+
+	MakeTestWAD(wad, num_lumps, 16);
+
+	start = Now();
+	vf = vfwrapfile(fopen(wad, "rb"));
+	vfread(header, 1, sizeof(header), vf);
+	vfseek(vf, header[8] | (header[9] << 8) | (header[10] << 16)
+	         | ((uint32_t) header[11] << 24), SEEK_SET);
+	for (i = 0; i < num_lumps; i++) {
+		vfread(&position, 4, 1, vf);
+		vfread(&size, 4, 1, vf);
+		vfread(name, 8, 1, vf);
+	}
+	vfclose(vf);
+	Report("read, three calls per entry", start);
+
+	start = Now();
+	wf = W_OpenFile(wad);
+	Report("W_OpenFile", start);
+
+	// Only the directory write is timed, not the sync.
+	W_SetSyncMode(wf, WAD_SYNC_ON_CLOSE, 0, 0);
+	W_SetLumpName(wf, 0, "RENAMED");
+	start = Now();
+	W_CommitChanges(wf);
+	Report("W_CommitChanges", start);
+
+	dir = W_GetDirectory(wf);
+	start = Now();
+	vf = vfwrapfile(fopen(out, "wb"));
+	for (i = 0; i < num_lumps; i++) {
+		vfwrite(&dir[i].position, 4, 1, vf);
+		vfwrite(&dir[i].size, 4, 1, vf);
+		vfwrite(dir[i].name, 8, 1, vf);
+	}
+	vfflush(vf);
+	Report("write, three calls per entry", start);
+	vfclose(vf);
+
+	W_CloseFile(wf);
+	free(wad);
+	free(out);
+}
+
+// Undo and redo after reversing the order of the directory, which used to
+// defeat the search for lump headers that had already been read. Restoring
+// a snapshot takes headers from the header cache; a fresh open has to read
+// them all from the file. Only headers are read, so the lumps are small.
+static void UndoBenchmark(void)
+{
+	char *wad = WorkPath("undo.wad");
+	double start, elapsed, best = 0;
+	VFILE *before, *after;
+	struct wad_file *wf;
+	unsigned int i, n;
+	int round;
+
+	MakeTestWAD(wad, num_lumps, 64);
+	wf = W_OpenFile(wad);
+	W_SetSyncMode(wf, WAD_SYNC_ON_CLOSE, 0, 0);
+	ReadAllHeaders(wf);
+	before = W_SaveSnapshot(wf);
+	n = W_NumLumps(wf);
+	for (i = 0; i < n / 2; i++) {
+		W_SwapEntries(wf, i, n - 1 - i);
+	}
+	W_CommitChanges(wf);
+	after = W_SaveSnapshot(wf);
+
+	for (round = 0; round < 20; round++) {
+		start = Now();
+		W_RestoreSnapshot(wf, before);
+		ReadAllHeaders(wf);
+		before = W_SaveSnapshot(wf);
+		W_RestoreSnapshot(wf, after);
+		ReadAllHeaders(wf);
+		after = W_SaveSnapshot(wf);
+		elapsed = Now() - start;
+		if (round == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	vfclose(before);
+	vfclose(after);
+	W_CloseFile(wf);
+	ReportTime("undo + redo, best of 20", best);
+
+	start = Now();
+	wf = W_OpenFile(wad);
+	ReadAllHeaders(wf);
+	Report("W_OpenFile + all lump headers", start);
+	W_CloseFile(wf);
+	free(wad);
+}
+
+// Copies with a read/write loop using the given buffer size, like vfcopy
+// used to with a 256 byte buffer and still does when it can't copy in the
+// kernel.
+static void CopyLoop(VFILE *from, VFILE *to, size_t buf_len)
+{
+	uint8_t *buf = checked_malloc(buf_len);
+	size_t nbytes;
+
+	while ((nbytes = vfread(buf, 1, buf_len, from)) > 0) {
+		vfwrite(buf, 1, nbytes, to);
+	}
+	free(buf);
+}
+
+static void CopyWith(int method, VFILE *from, VFILE *to)
+{
+	switch (method) {
+	case 0:
+		CopyLoop(from, to, 256);
+		break;
+	case 1:
+		CopyLoop(from, to, 64 * 1024);
+		break;
+	default:
+		vfcopy(from, to);
+		break;
+	}
+}
+
+// Times one copy between a file and/or a lump of the given WAD.
+static double TimeCopy(int method, const char *src, const char *dst,
+                       struct wad_file *wf, bool to_lump, bool from_lump)
+{
+	VFILE *from = NULL, *to = NULL;
+	double start;
+
+	if (!from_lump) {
+		from = vfwrapfile(fopen(src, "rb"));
+	}
+	if (!to_lump) {
+		to = vfwrapfile(fopen(dst, "wb"));
+	}
+	start = Now();
+	if (from_lump) {
+		from = W_OpenLump(wf, 0);
+	}
+	if (to_lump) {
+		to = W_OpenLumpRewrite(wf, 0);
+	}
+	CopyWith(method, from, to);
+	if (to_lump) {
+		vfclose(to);
+	} else {
+		vfflush(to);
+	}
+	start = Now() - start;
+
+	vfclose(from);
+	if (to_lump) {
+		W_CommitChanges(wf);
+	} else {
+		vfclose(to);
+	}
+
+	return start;
+}
+
+// vfcopy against read/write loops, for a large file copied to another
+// file, imported into a WAD and exported from it again (best of 5).
+static void CopyBenchmark(void)
+{
+	static const char *methods[] = {"256 byte loop", "64KB loop", "vfcopy"};
+	static const char *cases[] = {"file to file", "file to lump",
+	                              "lump to file"};
+	char *src = WorkPath("copy.src"), *dst = WorkPath("copy.dst");
+	char *wad = WorkPath("copy.wad"), what[64];
+	static uint8_t buf[MAX_LUMP_SIZE];
+	double elapsed, best;
+	int i, c, method;
+	struct wad_file *wf;
+	FILE *fs;
+
+	fs = fopen(src, "wb");
+	for (i = 0; i < COPY_SIZE; i += sizeof(buf)) {
+		FillBuffer(buf, sizeof(buf), i);
+		fwrite(buf, 1, min(sizeof(buf), COPY_SIZE - i), fs);
+	}
+	fclose(fs);
+	MakeTestWAD(wad, 1, 16);
+	wf = W_OpenFile(wad);
+	W_SetSyncMode(wf, WAD_SYNC_ON_CLOSE, 0, 0);
+
+	// The lump is written first, so that there is something to export.
+	for (c = 0; c < arrlen(cases); c++) {
+		for (method = 0; method < arrlen(methods); method++) {
+			best = 0;
+			for (i = 0; i < 5; i++) {
+				elapsed = TimeCopy(method, src, dst, wf,
+				                   c == 1, c == 2);
+				if (i == 0 || elapsed < best) {
+					best = elapsed;
+				}
+			}
+			snprintf(what, sizeof(what), "%s, %s",
+			         cases[c], methods[method]);
+			ReportTime(what, best);
+		}
+	}
+
+	W_CloseFile(wf);
+	free(src);
+	free(dst);
+	free(wad);
+}
+
+static void CompactOne(const char *what, bool dedupe)
+{
+	char *wad = CopyOfTestWAD("compact.wad");
+	struct wad_file *wf = W_OpenFile(wad);
+	double start;
+
+	start = Now();
+	if (!W_CompactWAD(wf, dedupe)) {
+		Fail("compaction failed");
+	}
+	Report(what, start);
+	W_CloseFile(wf);
+	free(wad);
+}
+
+static void CompactBenchmark(void)
+{
+	CompactOne("W_CompactWAD", false);
+	CompactOne("W_CompactWAD (dedupe)", true);
+}
+
+static const struct benchmark benchmarks[] = {
+	{"open",       OpenBenchmark},
+	{"export",     ExportBenchmark},
+	{"import",     ImportBenchmark},
+	{"compact",    CompactBenchmark},
+	{"directory",  DirectoryBenchmark},
+	{"undo",       UndoBenchmark},
+	{"copy",       CopyBenchmark},
+};
+
+static void Usage(void)
+{
+	int i;
+
+	fprintf(stderr, "Usage: wadbench [-n lumps] "
+	        "[-s seek_usec,usec_per_kb[,sync_usec]] [benchmark...]\n"
+	        "Benchmarks:");
+	for (i = 0; i < arrlen(benchmarks); i++) {
+		fprintf(stderr, " %s", benchmarks[i].name);
+	}
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static const struct benchmark *FindBenchmark(const char *name)
+{
+	int i;
+
+	for (i = 0; i < arrlen(benchmarks); i++) {
+		if (!strcmp(name, benchmarks[i].name)) {
+			return &benchmarks[i];
+		}
+	}
+
+	Usage();
+	return NULL;
+}
+
+static void RunBenchmark(const struct benchmark *b)
+{
+	printf("%s:\n", b->name);
+	b->run();
+}
+
+int main(int argc, char *argv[])
+{
+	struct vfile_slowio slowio = {0, 0, 0};
+	bool slow = false;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_lumps = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%u,%u,%u", &slowio.seek_usec,
+			           &slowio.usec_per_kb,
+			           &slowio.sync_usec) < 2) {
+				Usage();
+			}
+			slow = true;
+			break;
+		default:
+			Usage();
+		}
+	}
+	if (num_lumps == 0) {
+		Usage();
+	}
+	for (i = optind; i < argc; i++) {
+		FindBenchmark(argv[i]);
+	}
+
+	if (mkdtemp(work_dir) == NULL) {
+		Fail("failed to create working directory");
+	}
+	atexit(RemoveWorkDir);
+	InitHiddenUI();
+	if (slow) {
+		vfsimulateslowio(&slowio);
+	}
+
+	for (i = optind; i < argc; i++) {
+		RunBenchmark(FindBenchmark(argv[i]));
+	}
+	if (optind >= argc) {
+		for (i = 0; i < arrlen(benchmarks); i++) {
+			RunBenchmark(&benchmarks[i]);
+		}
+	}
+
+	return 0;
+}
@@ -842,23 +842,26 @@ static void PerformMarkPattern(void)
 	struct directory_entry *first_match;
 	size_t old_cnt;
 
-	char *glob = UI_TextInputDialogBox(
-		"Mark pattern", "Mark", 15,
-		"Enter a wildcard pattern (eg. *.png):");
-	if (glob == NULL) {
+	char *pattern = UI_TextInputDialogBox(
+		"Mark pattern", "Mark", 63,
+		"Enter a wildcard pattern (eg. *.png),\n"
+		"or a regular expression (eg. /^E[1-4]M[1-9]$/).\n"
+		"Start with ! to mark what doesn't match.");
+	if (pattern == NULL) {
 		return;
 	}
 	old_cnt = active_pane->tagged.num_entries;
-	first_match = VFS_AddGlobToSet(active_pane->dir,
-	                               &active_pane->tagged, glob);
-	if (first_match == NULL) {
+	if (!VFS_AddPatternToSet(active_pane->dir, &active_pane->tagged,
+	                         pattern, &first_match)) {
+		UI_MessageBox("%s", VFS_LastError());
+	} else if (first_match == NULL) {
 		UI_ShowNotice("No matches found.");
 	} else {
 		B_DirectoryPaneSelectEntry(active_pane, first_match);
 		UI_ShowNotice("%d marked.",
 		              active_pane->tagged.num_entries - old_cnt);
 	}
-	free(glob);
+	free(pattern);
 }
 
 const struct action mark_pattern_action = {
@@ -932,11 +935,12 @@ static void CheckCompactWad(struct directory_pane *pane)
 	filename = PathBaseName(pane->dir->path);
 	if (!UI_ConfirmDialogBox(
 		"Compact WAD", "Compact", "Ignore",
-		"'%s' contains %dKB of junk data.\nCompact now?",
+		"'%s' contains %dKB of junk data.\nCompact now? Interrupting "
+		"compaction\nmay damage the WAD.",
 		filename, junk_bytes_kb)) {
 		return;
 	}
-	if (W_CompactWAD(wf)) {
+	if (W_CompactWAD(wf, false)) {
 		UI_ShowNotice("WAD compacted; %dKB saved.", junk_bytes_kb);
 	} else {
 		UI_MessageBox("Error when compacting '%s'.", filename);
@@ -1060,13 +1064,14 @@ const struct action view_action = {
 	PerformView,
 };
 
-static void PerformCompact(void)
+static void CompactSelected(bool dedupe)
 {
 	struct directory_entry *ent;
 	struct directory *wad_dir;
 	struct wad_file *wf;
-	uint32_t junk_bytes;
+	uint32_t junk_bytes, dup_bytes = 0;
 	int selected;
+	bool ok;
 
 	selected = B_DirectoryPaneSelected(active_pane);
 	if (selected < 0) {
@@ -1099,25 +1104,42 @@ static void PerformCompact(void)
 	}
 
 	junk_bytes = W_NumJunkBytes(wf);
-	if (junk_bytes == 0) {
-		UI_ShowNotice("'%s' cannot be made any smaller.", ent->name);
-		goto fail;
+	if (dedupe) {
+		dup_bytes = W_NumDuplicateBytes(wf);
 	}
-	if (!UI_ConfirmDialogBox("Compact WAD", "Compact", "Cancel",
-	                         "'%s' contains %d junk bytes.\n"
-	                         "Compact WAD? This operation cannot\n"
-	                         "be undone.", ent->name, junk_bytes)) {
+	if (junk_bytes == 0 && dup_bytes == 0) {
+		UI_ShowNotice("'%s' cannot be made any smaller.", ent->name);
 		goto fail;
 	}
-	if (!B_CheckReadOnly(wad_dir)) {
+	if (dedupe) {
+		ok = UI_ConfirmDialogBox(
+			"Compact WAD", "Compact", "Cancel",
+			"'%s' contains %d junk bytes and\n"
+			"%d bytes of duplicated lumps.\n"
+			"Compact WAD and merge duplicates?\n"
+			"This operation cannot be undone.\n"
+			"Do not interrupt it, or the WAD\n"
+			"may be damaged.",
+			ent->name, junk_bytes, dup_bytes);
+	} else {
+		ok = UI_ConfirmDialogBox(
+			"Compact WAD", "Compact", "Cancel",
+			"'%s' contains %d junk bytes.\n"
+			"Compact WAD? This operation cannot\n"
+			"be undone. Do not interrupt it, or\n"
+			"the WAD may be damaged.",
+			ent->name, junk_bytes);
+	}
+	if (!ok || !B_CheckReadOnly(wad_dir)) {
 		goto fail;
 	}
-	if (!W_CompactWAD(wf)) {
+	if (!W_CompactWAD(wf, dedupe)) {
 		UI_MessageBox("Failed to compact '%s'.", ent->name);
 		goto fail;
 	}
 
-	UI_ShowNotice("WAD compacted; %dKB saved.", junk_bytes / 1000);
+	UI_ShowNotice("WAD compacted; %dKB saved.",
+	              (junk_bytes + dup_bytes) / 1000);
 
 	VFS_Refresh(wad_dir);
 	VFS_Refresh(active_pane->dir);
@@ -1128,11 +1150,26 @@ fail:
 	VFS_CloseDir(wad_dir);
 }
 
+static void PerformCompact(void)
+{
+	CompactSelected(false);
+}
+
 const struct action compact_action = {
 	KEY_F(2), 'T',  "Compact", "Compact WAD file",
 	PerformCompact,
 };
 
+static void PerformCompactDedupe(void)
+{
+	CompactSelected(true);
+}
+
+const struct action compact_dedupe_action = {
+	SHIFT_KEY_F(2), 0, NULL, "Compact WAD (merge duplicates)",
+	PerformCompactDedupe,
+};
+
 static void PerformHexdump(void)
 {
 	int selected = B_DirectoryPaneSelected(active_pane);
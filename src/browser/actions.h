@@ -50,6 +50,7 @@ extern const struct action open_shell_action;
 extern const struct action view_action;
 extern const struct action hexdump_action;
 extern const struct action compact_action;
+extern const struct action compact_dedupe_action;
 
 extern const struct action undo_action;
 extern const struct action redo_action;
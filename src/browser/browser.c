@@ -218,6 +218,7 @@ static const struct action *wad_actions[] = {
 
 static const struct action *dir_actions[] = {
 	&compact_action,
+	&compact_dedupe_action,
 	&open_shell_action,
 	&make_wad_action,
 	&make_wad_noconv_action,
@@ -623,6 +624,27 @@ static void InitSearchPane(WINDOW *win)
 	UI_TextInputInit(&search_pane.input, win, 256);
 }
 
+// Called when directories may have been changed by another program; we
+// pick up the changes while keeping the same entries selected.
+static void DirectoriesChanged(void)
+{
+	uint64_t serial_nos[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		serial_nos[i] =
+			B_DirectoryPaneEntry(browser_panes[i])->serial_no;
+	}
+
+	VFS_RefreshAll();
+
+	for (i = 0; i < 2; i++) {
+		B_DirectoryPaneReselect(browser_panes[i]);
+		B_DirectoryPaneSelectBySerial(browser_panes[i],
+		                              serial_nos[i]);
+	}
+}
+
 void B_Shutdown(void)
 {
 	TF_RestoreOldPalette();
@@ -673,4 +695,6 @@ void B_Init(const char *path1, const char *path2)
 	B_SwitchToPane(browser_panes[0]);
 
 	SetWindowSizes();
+
+	UI_SetWatchDescriptor(VFS_WatchDescriptor(), DirectoriesChanged);
 }
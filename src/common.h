@@ -26,6 +26,12 @@
 
 #define or_if_null(x, y) ((x) != NULL ? (x) : (y))
 
+// Yes, Si units, not binary ones.
+#define KB(x) ((x) * 1000ULL)
+#define MB(x) (KB(x) * 1000ULL)
+#define GB(x) (MB(x) * 1000ULL)
+#define TB(x) (GB(x) * 1000ULL)
+
 static inline void *check_allocation_result(void *x)
 {
 	assert(x != NULL);
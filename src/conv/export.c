@@ -11,9 +11,11 @@
 #include "conv/export.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "common.h"
 #include "conv/audio.h"
 #include "conv/error.h"
 #include "ui/dialog.h"
@@ -223,6 +225,7 @@ bool ExportToFile(struct directory *from, struct directory_entry *ent,
 		vfclose(fromlump);
 		return false;
 	}
+	vfsetname(tofile, to_filename);
 
 	vfcopy(fromlump, tofile);
 	vfclose(fromlump);
@@ -298,6 +301,9 @@ bool PerformExport(struct directory *from, struct file_set *from_set,
 	char *filename, *filename2;
 	struct directory_entry *ent, *ent2;
 	struct progress_window progress;
+	struct file_set done = EMPTY_FILE_SET;
+	uint64_t *done_serials, *new_serials;
+	size_t num_done = 0, num_new = 0;
 	bool success;
 	int idx;
 
@@ -329,17 +335,33 @@ bool PerformExport(struct directory *from, struct file_set *from_set,
 
 	VFS_Refresh(to);
 
+	// Serial numbers are collected and added to the sets all in one go,
+	// since adding them one at a time is slow.
+	done_serials = checked_malloc(
+		sizeof(uint64_t) * (from_set->num_entries + 1));
+	new_serials = checked_malloc(
+		sizeof(uint64_t) * (from_set->num_entries + 1));
+
 	idx = 0;
 	while ((ent = VFS_IterateSet(from, from_set, &idx)) != NULL) {
 		const struct lump_type *lt = IdentifyLumpType(from, ent);
-		VFS_RemoveFromSet(from_set, ent->serial_no);
+		done_serials[num_done] = ent->serial_no;
+		++num_done;
 		filename = FileNameForEntry(lt, ent, convert);
 		ent2 = VFS_EntryByName(to, filename);
 		free(filename);
 		if (ent2 != NULL) {
-			VFS_AddToSet(result, ent2->serial_no);
+			new_serials[num_new] = ent2->serial_no;
+			++num_new;
 		}
 	}
 
+	VFS_AddManyToSet(result, new_serials, num_new);
+	VFS_AddManyToSet(&done, done_serials, num_done);
+	VFS_RemoveSetFromSet(from_set, &done);
+	VFS_FreeSet(&done);
+	free(done_serials);
+	free(new_serials);
+
 	return true;
 }
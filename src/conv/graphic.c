@@ -346,7 +346,7 @@ static bool ValidatePatch(const struct patch_header *hdr,
 	return true;
 }
 
-static void DrawPatch(const struct patch_header *hdr, uint8_t *srcbuf,
+static void DrawPatch(const struct patch_header *hdr, const uint8_t *srcbuf,
                       size_t srcbuf_len, uint8_t *dstbuf, int trans_color)
 {
 	uint32_t *columnofs =
@@ -377,21 +377,22 @@ static void DrawPatch(const struct patch_header *hdr, uint8_t *srcbuf,
 
 VFILE *V_ToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf, *imgbuf = NULL;
+	const uint8_t *buf;
+	uint8_t *imgbuf = NULL;
+	void *to_free;
 	struct patch_header hdr;
 	size_t buf_len;
 	bool has_transparency;
 	int transparent_color = 0;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfmapall(input, &buf_len, &to_free);
 	if (buf_len < 6) {
 		ConversionError("Patch too short: %d < 6", (int) buf_len);
 		goto fail;
 	}
 
-	hdr = *((struct patch_header *) buf);
+	memcpy(&hdr, buf, sizeof(struct patch_header));
 	V_SwapPatchHeader(&hdr);
 	imgbuf = checked_malloc(hdr.width * hdr.height);
 	if (!ValidatePatch(&hdr, buf, buf_len)) {
@@ -410,20 +411,21 @@ VFILE *V_ToImageFile(VFILE *input, const struct palette *pal)
 
 fail:
 	free(imgbuf);
-	free(buf);
+	free(to_free);
+	vfclose(input);
 
 	return result;
 }
 
 VFILE *V_FlatToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf;
+	const uint8_t *buf;
+	void *to_free;
 	struct patch_header hdr;
 	size_t buf_len;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfmapall(input, &buf_len, &to_free);
 
 	// Most flats are 64x64, but Heretic/Hexen animated ones are larger.
 	if (buf_len < 4096 || (buf_len % 64) != 0) {
@@ -438,7 +440,8 @@ VFILE *V_FlatToImageFile(VFILE *input, const struct palette *pal)
 	result = V_WritePalettizedPNG(&hdr, buf, pal, false, 0);
 
 fail:
-	free(buf);
+	free(to_free);
+	vfclose(input);
 
 	return result;
 }
@@ -446,13 +449,13 @@ fail:
 // For Hexen fullscreen images.
 VFILE *V_FullscreenToImageFile(VFILE *input, const struct palette *pal)
 {
-	uint8_t *buf;
+	const uint8_t *buf;
+	void *to_free;
 	struct patch_header hdr;
 	size_t buf_len;
 	VFILE *result = NULL;
 
-	buf = vfreadall(input, &buf_len);
-	vfclose(input);
+	buf = vfmapall(input, &buf_len, &to_free);
 	assert(buf_len == FULLSCREEN_SZ);
 
 	hdr.width = FULLSCREEN_W;
@@ -460,12 +463,13 @@ VFILE *V_FullscreenToImageFile(VFILE *input, const struct palette *pal)
 	hdr.topoffset = 0;
 	hdr.leftoffset = 0;
 	result = V_WritePalettizedPNG(&hdr, buf, pal, false, 0);
-	free(buf);
+	free(to_free);
+	vfclose(input);
 
 	return result;
 }
 
-static void ReadHiresPalette(uint8_t *buf, struct palette *palette)
+static void ReadHiresPalette(const uint8_t *buf, struct palette *palette)
 {
 	unsigned int i, r, g, b;
 
@@ -479,7 +483,7 @@ static void ReadHiresPalette(uint8_t *buf, struct palette *palette)
 	}
 }
 
-static uint8_t *PlanarToFlat(void *src, struct palette *palette)
+static uint8_t *PlanarToFlat(const uint8_t *src, struct palette *palette)
 {
 	const uint8_t *srcptrs[4];
 	uint8_t srcbits[4], *dest, *result;
@@ -522,17 +526,19 @@ static uint8_t *PlanarToFlat(void *src, struct palette *palette)
 VFILE *V_HiresToImageFile(VFILE *input)
 {
 	VFILE *result;
-	uint8_t *lump, *screenbuf;
+	const uint8_t *lump;
+	uint8_t *screenbuf;
+	void *to_free;
 	size_t lump_len;
 	struct palette palette;
 	struct patch_header hdr;
 
-	lump = vfreadall(input, &lump_len);
-	vfclose(input);
+	lump = vfmapall(input, &lump_len, &to_free);
 	if (lump_len < HIRES_MIN_LENGTH) {
 		ConversionError("Hires image too short: %d < %d bytes",
 		                (int) lump_len, (int) HIRES_MIN_LENGTH);
-		free(lump);
+		free(to_free);
+		vfclose(input);
 		return NULL;
 	}
 
@@ -544,7 +550,8 @@ VFILE *V_HiresToImageFile(VFILE *input)
 	result = V_WritePalettizedPNG(&hdr, screenbuf, &palette, false, 0);
 
 	free(screenbuf);
-	free(lump);
+	free(to_free);
+	vfclose(input);
 
 	return result;
 }
@@ -11,10 +11,12 @@
 #include "conv/import.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <strings.h>
 
+#include "common.h"
 #include "conv/audio.h"
 #include "conv/error.h"
 #include "conv/graphic.h"
@@ -156,10 +158,30 @@ static VFILE *PerformConversion(VFILE *input, struct directory *to_wad,
 	return input;
 }
 
-bool ImportFromFile(VFILE *from_file, const char *src_name,
+// Returns the size of a file on disk, or -1 if it can't be found.
+static int64_t FileSize(VFILE *f)
+{
+	long result;
+
+	if (vfseek(f, 0, SEEK_END) != 0) {
+		return -1;
+	}
+	result = vftell(f);
+	if (vfseek(f, 0, SEEK_SET) != 0) {
+		return -1;
+	}
+
+	return result;
+}
+
+bool ImportFromFile(VFILE *from_file, const char *src_name, int64_t src_size,
                     struct directory *to_wad, int lumpnum, bool convert)
 {
+	struct wad_file *wf = VFS_WadFile(to_wad);
 	VFILE *to_lump;
+	size_t buf_len;
+	void *buf;
+	bool success;
 
 	if (convert) {
 		from_file = PerformConversion(from_file, to_wad, src_name);
@@ -169,11 +191,29 @@ bool ImportFromFile(VFILE *from_file, const char *src_name,
 		return false;
 	}
 
-	to_lump = W_OpenLumpRewrite(VFS_WadFile(to_wad), lumpnum);
-	vfcopy(from_file, to_lump);
+	// Conversions always produce their output in memory, as do lumps
+	// that are mapped, so we can tell exactly how big it is. Anything
+	// else has been passed through unchanged.
+	if (vfgetbuf(from_file, &buf, &buf_len)) {
+		src_size = buf_len - vftell(from_file);
+	}
+
+	// If we know how big the lump will be, space can be set aside for it
+	// up front and the data written straight there, rather than being
+	// buffered until we find out.
+	if (src_size >= 0 && src_size <= UINT32_MAX) {
+		to_lump = W_OpenLumpRewriteSized(wf, lumpnum, src_size);
+	} else {
+		to_lump = W_OpenLumpRewrite(wf, lumpnum);
+	}
+	success = vfcopy(from_file, to_lump) == 0;
 	vfclose(from_file);
 	vfclose(to_lump);
-	return true;
+
+	if (!success) {
+		ConversionError("Failed to import '%s'", src_name);
+	}
+	return success;
 }
 
 bool PerformImport(struct directory *from, struct file_set *from_set,
@@ -181,10 +221,15 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
                    struct file_set *result, bool convert)
 {
 	VFILE *from_file;
+	int64_t src_size;
 	struct directory_entry *ent;
 	struct wad_file *to_wad;
 	struct wad_file_entry *waddir;
 	struct progress_window progress;
+	struct file_set done = EMPTY_FILE_SET;
+	uint64_t *done_serials, *new_serials;
+	size_t num_done = 0;
+	bool success = true;
 	char namebuf[9];
 	int idx, lumpnum;
 
@@ -204,6 +249,13 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
 	// We only ever do conversions when importing from files.
 	convert = convert && from->type == FILE_TYPE_DIR;
 
+	// Serial numbers are collected as we go and added to the sets all in
+	// one go at the end, since adding them one at a time is slow.
+	done_serials = checked_malloc(
+		sizeof(uint64_t) * (from_set->num_entries + 1));
+	new_serials = checked_malloc(
+		sizeof(uint64_t) * (from_set->num_entries + 1));
+
 	idx = 0;
 	while ((ent = VFS_IterateSet(from, from_set, &idx)) != NULL) {
 
@@ -211,20 +263,37 @@ bool PerformImport(struct directory *from, struct file_set *from_set,
 		W_SetLumpName(to_wad, lumpnum, namebuf);
 
 		from_file = VFS_OpenByEntry(from, ent);
+		// The size of a lump in a WAD is exact, but a file on disk
+		// may have changed since the directory was read.
+		if (from->type == FILE_TYPE_DIR) {
+			src_size = FileSize(from_file);
+		} else {
+			src_size = ent->size;
+		}
 
-		if (!ImportFromFile(from_file, ent->name, to, lumpnum,
-		                    convert)) {
+		if (!ImportFromFile(from_file, ent->name, src_size, to,
+		                    lumpnum, convert)) {
 			VFS_Rollback(to);
-			return false;
+			success = false;
+			break;
 		}
 
-		VFS_AddToSet(result, waddir[lumpnum].serial_no);
+		new_serials[num_done] = waddir[lumpnum].serial_no;
+		done_serials[num_done] = ent->serial_no;
+		++num_done;
 		++lumpnum;
-
-		VFS_RemoveFromSet(from_set, ent->serial_no);
 		UI_UpdateProgressWindow(&progress, ent->name);
 	}
 
-	VFS_Refresh(to);
-	return true;
+	// Imported entries are removed from from_set, even on failure.
+	VFS_AddManyToSet(&done, done_serials, num_done);
+	VFS_RemoveSetFromSet(from_set, &done);
+	VFS_FreeSet(&done);
+	if (success) {
+		VFS_AddManyToSet(result, new_serials, num_done);
+		VFS_Refresh(to);
+	}
+	free(done_serials);
+	free(new_serials);
+	return success;
 }
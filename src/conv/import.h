@@ -19,7 +19,8 @@
 struct directory;
 struct file_set;
 
-bool ImportFromFile(VFILE *from_file, const char *src_name,
+// src_size is the size of from_file if it is known, or -1.
+bool ImportFromFile(VFILE *from_file, const char *src_name, int64_t src_size,
                     struct directory *to_wad, int lumpnum, bool convert);
 bool PerformImport(struct directory *from, struct file_set *from_set,
                    struct directory *to, int to_index,
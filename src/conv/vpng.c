@@ -307,7 +307,7 @@ static png_color *MakePNGPalette(const struct palette *palette)
 	return result;
 }
 
-VFILE *V_WritePalettizedPNG(struct patch_header *hdr, uint8_t *imgbuf,
+VFILE *V_WritePalettizedPNG(struct patch_header *hdr, const uint8_t *imgbuf,
                             const struct palette *palette,
                             bool set_transparency, int transparent_color)
 {
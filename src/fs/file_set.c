@@ -14,10 +14,36 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <regex.h>
 
 #include "common.h"
 #include "fs/vfs.h"
 
+// The entries array is not shrunk when entries are removed, so we don't
+// keep track of its real size. Instead it is always grown to a power of
+// two, so that appending one entry at a time doesn't need to realloc()
+// every time; this is the size it must have for a given number of entries.
+static size_t SetCapacity(size_t num_entries)
+{
+	size_t result = 16;
+
+	if (num_entries == 0) {
+		return 0;
+	}
+	while (result < num_entries) {
+		result *= 2;
+	}
+	return result;
+}
+
+static void GrowSet(struct file_set *l, size_t num_entries)
+{
+	if (SetCapacity(num_entries) > SetCapacity(l->num_entries)) {
+		l->entries = checked_realloc(l->entries,
+			sizeof(uint64_t) * SetCapacity(num_entries));
+	}
+}
+
 void VFS_ClearSet(struct file_set *l)
 {
 	l->num_entries = 0;
@@ -54,47 +80,236 @@ void VFS_AddToSet(struct file_set *l, uint64_t serial_no)
 		return;
 	}
 
-	l->entries = checked_realloc(l->entries,
-		sizeof(uint64_t) * (l->num_entries + 1));
+	GrowSet(l, l->num_entries + 1);
 	memmove(&l->entries[entries_index + 1], &l->entries[entries_index],
 	        sizeof(uint64_t) * (l->num_entries - entries_index));
 	l->entries[entries_index] = serial_no;
 	++l->num_entries;
 }
 
-static bool GlobMatch(const char *pattern, const char *s)
+// Longest glob pattern that can be compiled. Each position in the pattern
+// is a bit in a uint64_t, with one more for the end of the pattern.
+#define MAX_GLOB_LEN 63
+
+// A compiled pattern. Globs are matched by simulating an NFA with one
+// state per pattern position, all at once using bit masks, so matching
+// takes linear time however many wildcards there are.
+struct entry_pattern {
+	bool negate, is_regex;
+	regex_t regex;
+	uint64_t star_mask, any_mask, char_masks[256];
+	uint64_t accept_mask;
+};
+
+static bool CompileGlob(struct entry_pattern *p, const char *glob)
+{
+	uint64_t last_bit;
+	int len = 0, c;
+
+	for (; *glob != '\0'; ++glob) {
+		// A run of stars is the same as a single one.
+		last_bit = len > 0 ? 1ULL << (len - 1) : 0;
+		if (*glob == '*' && (p->star_mask & last_bit) != 0) {
+			continue;
+		}
+		if (len >= MAX_GLOB_LEN) {
+			VFS_StoreError("Pattern is too long.");
+			return false;
+		}
+		if (*glob == '*') {
+			p->star_mask |= 1ULL << len;
+		} else if (*glob == '?') {
+			p->any_mask |= 1ULL << len;
+		} else {
+			c = (unsigned char) *glob;
+			p->char_masks[tolower(c)] |= 1ULL << len;
+			p->char_masks[toupper(c)] |= 1ULL << len;
+		}
+		++len;
+	}
+	p->accept_mask = 1ULL << len;
+
+	return true;
+}
+
+static bool GlobMatch(const struct entry_pattern *p, const char *s)
+{
+	uint64_t states = 1;
+
+	// A star can match nothing, so it lets us skip ahead one position.
+	// Runs of stars were collapsed, so once is enough.
+	states |= (states & p->star_mask) << 1;
+
+	for (; *s != '\0' && states != 0; ++s) {
+		states = (states & p->star_mask)
+		       | ((states & (p->any_mask
+		                  | p->char_masks[(unsigned char) *s])) << 1);
+		states |= (states & p->star_mask) << 1;
+	}
+
+	return (states & p->accept_mask) != 0;
+}
+
+// Patterns are globs, unless they are between slashes, in which case they
+// are regular expressions. Either can be negated with a leading '!'.
+static bool CompilePattern(struct entry_pattern *p, const char *pattern)
+{
+	char *regex, errbuf[64];
+	size_t len;
+	int err;
+
+	memset(p, 0, sizeof(*p));
+
+	if (*pattern == '!') {
+		p->negate = true;
+		++pattern;
+	}
+	if (*pattern != '/') {
+		return CompileGlob(p, pattern);
+	}
+
+	regex = checked_strdup(pattern + 1);
+	len = strlen(regex);
+	if (len > 0 && regex[len - 1] == '/') {
+		regex[len - 1] = '\0';
+	}
+	err = regcomp(&p->regex, regex, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	free(regex);
+	if (err != 0) {
+		regerror(err, &p->regex, errbuf, sizeof(errbuf));
+		VFS_StoreError("Invalid regular expression: %s", errbuf);
+		return false;
+	}
+	p->is_regex = true;
+
+	return true;
+}
+
+static bool PatternMatch(const struct entry_pattern *p, const char *s)
 {
-	switch (*pattern) {
-	case '*':
-		return GlobMatch(pattern + 1, s)
-		    || (*s != '\0' && GlobMatch(pattern, s + 1));
-	case '\0':
-		return *s == '\0';
-	case '?':
-		return *s != '\0' && GlobMatch(pattern + 1, s + 1);
-	default:
-		return tolower(*s) == tolower(*pattern)
-		    && GlobMatch(pattern + 1, s + 1);
+	bool result;
+
+	if (p->is_regex) {
+		result = regexec(&p->regex, s, 0, NULL, 0) == 0;
+	} else {
+		result = GlobMatch(p, s);
 	}
+
+	return result != p->negate;
 }
 
-// Mark all entries matching glob pattern. Returns first entry matched.
-struct directory_entry *VFS_AddGlobToSet(
-	struct directory *dir, struct file_set *l, const char *glob)
+static void FreePattern(struct entry_pattern *p)
 {
-	struct directory_entry *ent, *result = NULL;
+	if (p->is_regex) {
+		regfree(&p->regex);
+	}
+}
+
+static int CompareSerials(const void *x, const void *y)
+{
+	uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+
+	return (a > b) - (a < b);
+}
+
+// Merges the sorted serial numbers in `serials` into the set.
+static void MergeIntoSet(struct file_set *l, const uint64_t *serials,
+                         size_t count)
+{
+	uint64_t *merged;
+	size_t i = 0, j = 0, n = 0;
+
+	if (count == 0) {
+		return;
+	}
+
+	merged = checked_malloc(
+		sizeof(uint64_t) * SetCapacity(l->num_entries + count));
+
+	while (i < l->num_entries || j < count) {
+		if (j >= count
+		 || (i < l->num_entries && l->entries[i] < serials[j])) {
+			merged[n++] = l->entries[i++];
+		} else {
+			if (i < l->num_entries && l->entries[i] == serials[j]) {
+				++i;
+			}
+			if (n == 0 || merged[n - 1] != serials[j]) {
+				merged[n++] = serials[j];
+			}
+			++j;
+		}
+	}
+
+	free(l->entries);
+	l->entries = merged;
+	l->num_entries = n;
+}
+
+void VFS_AddManyToSet(struct file_set *l, const uint64_t *serials,
+                      size_t count)
+{
+	uint64_t *sorted = checked_malloc(sizeof(uint64_t) * (count + 1));
+
+	memcpy(sorted, serials, sizeof(uint64_t) * count);
+	qsort(sorted, count, sizeof(uint64_t), CompareSerials);
+	MergeIntoSet(l, sorted, count);
+	free(sorted);
+}
+
+void VFS_RemoveSetFromSet(struct file_set *from, struct file_set *set)
+{
+	size_t i, j = 0, n = 0;
+
+	// Both are sorted, so this can be done in a single pass. The array
+	// never grows, so this is safe even for a set that is a view of a
+	// single entry (see B_DirectoryPaneTagged).
+	for (i = 0; i < from->num_entries; i++) {
+		while (j < set->num_entries
+		    && set->entries[j] < from->entries[i]) {
+			++j;
+		}
+		if (j >= set->num_entries
+		 || set->entries[j] != from->entries[i]) {
+			from->entries[n++] = from->entries[i];
+		}
+	}
+	from->num_entries = n;
+}
+
+bool VFS_AddPatternToSet(struct directory *dir, struct file_set *l,
+                         const char *pattern,
+                         struct directory_entry **first_match)
+{
+	struct entry_pattern p;
+	struct directory_entry *ent;
+	uint64_t *matches;
+	size_t num_matches = 0;
 	int i = 0;
 
+	*first_match = NULL;
+	if (!CompilePattern(&p, pattern)) {
+		return false;
+	}
+
+	matches = checked_malloc(sizeof(uint64_t) * (dir->num_entries + 1));
+
 	for (i = 0; i < dir->num_entries; ++i) {
 		ent = &dir->entries[i];
-		if (ent->type != FILE_TYPE_DIR && GlobMatch(glob, ent->name)) {
-			VFS_AddToSet(l, ent->serial_no);
-			if (result == NULL) {
-				result = ent;
+		if (ent->type != FILE_TYPE_DIR && PatternMatch(&p, ent->name)) {
+			matches[num_matches] = ent->serial_no;
+			++num_matches;
+			if (*first_match == NULL) {
+				*first_match = ent;
 			}
 		}
 	}
-	return result;
+
+	VFS_AddManyToSet(l, matches, num_matches);
+	free(matches);
+	FreePattern(&p);
+
+	return true;
 }
 
 void VFS_RemoveFromSet(struct file_set *l, uint64_t serial_no)
@@ -123,8 +338,10 @@ bool VFS_SetHas(struct file_set *l, uint64_t serial_no)
 
 void VFS_CopySet(struct file_set *to, struct file_set *from)
 {
+	free(to->entries);
 	to->num_entries = from->num_entries;
-	to->entries = checked_calloc(to->num_entries, sizeof(uint64_t));
+	to->entries = checked_calloc(SetCapacity(to->num_entries) + 1,
+	                             sizeof(uint64_t));
 	memcpy(to->entries, from->entries,
 	       to->num_entries * sizeof(uint64_t));
 }
@@ -139,10 +356,21 @@ void VFS_FreeSet(struct file_set *set)
 struct directory_entry *VFS_IterateSet(struct directory *dir,
                                        struct file_set *set, int *idx)
 {
+	uint64_t lowest, highest;
+
+	if (set->num_entries == 0) {
+		return NULL;
+	}
+	lowest = set->entries[0];
+	highest = set->entries[set->num_entries - 1];
+
 	while (*idx < dir->num_entries) {
 		struct directory_entry *ent = &dir->entries[*idx];
 		++*idx;
-		if (VFS_SetHas(set, ent->serial_no)) {
+		// Quick check first, to skip the search for most entries
+		// when a small set is iterated over a large directory.
+		if (ent->serial_no >= lowest && ent->serial_no <= highest
+		 && VFS_SetHas(set, ent->serial_no)) {
 			return ent;
 		}
 	}
@@ -16,12 +16,106 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <strings.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
 
 #include "common.h"
 #include "stringlib.h"
 #include "fs/vfs.h"
 #include "fs/vfile.h"
 
+// If more entries than this change at once, we just reread everything.
+#define MAX_CHANGED_NAMES 256
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB \
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+                      | IN_MOVE_SELF)
+
+// When reading a watched directory, after this many files have been
+// stat()ed, the sizes of the rest are left to the background thread.
+#define SYNC_STAT_LIMIT 256
+
+// How many files the background thread stat()s between wakeups of the
+// main thread, which then fills in the sizes.
+#define STAT_WAKEUP_INTERVAL 1024
+
+// Entry that has been stat()ed by RealDirChanges, to be filled in by
+// RealDirRefreshEntry once it has been moved to its final index.
+struct changed_entry {
+	unsigned int index;
+	struct directory_entry ent;
+};
+
+struct stat_result {
+	size_t name_index;
+	int64_t size;
+};
+
+// List of files for the background thread to stat(). Everything except
+// num_results and the state flags is only changed by the main thread
+// before the job is queued, and results are only ever appended, so the
+// main thread only needs the lock to read num_results.
+struct stat_job {
+	char *path;
+	char *names;
+	size_t *name_offsets;
+	size_t names_len, names_size, num_names;
+	struct stat_result *results;
+	size_t num_results, num_applied;
+	bool running, done, cancelled;
+	struct stat_job *next;
+};
+
+struct real_directory {
+	struct directory dir;
+	// inotify watch descriptor, or -1 if the directory is not being
+	// watched and must be reread in full on every refresh.
+	int watch;
+	// Names of entries that the kernel has told us about since the
+	// last refresh. If there were too many, or we lost track for some
+	// other reason, rescan is set instead.
+	char **changed_names;
+	size_t num_changed_names;
+	bool rescan;
+	// Names of entries that are symlinks. We aren't told when the
+	// things that they point to change, so they are always checked.
+	char **symlink_names;
+	size_t num_symlink_names;
+	// Changes found by the last call to RealDirChanges, and the names
+	// they refer to.
+	char **refresh_names;
+	size_t num_refresh_names;
+	struct changed_entry *changed;
+	size_t num_changed;
+	struct directory_change *changes;
+	size_t changes_size;
+	// Sizes of files that are still being read in the background.
+	struct stat_job *stat_job;
+	struct real_directory *next_watched;
+};
+
+#ifdef __linux__
+static int inotify_fd = -1;
+static struct real_directory *watched_dirs;
+
+// The main loop watches watch_fd, which combines the inotify descriptor
+// with wakeup_fd, which is signaled by the background thread.
+static int watch_fd = -1, wakeup_fd = -1;
+
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stat_cond = PTHREAD_COND_INITIALIZER;
+static struct stat_job *stat_queue;
+static bool stat_thread_started;
+#endif
+
 static int HasWadExtension(const char *name)
 {
 	const char *extn;
@@ -32,6 +126,12 @@ static int HasWadExtension(const char *name)
 	return !strcasecmp(extn, ".wad");
 }
 
+static enum file_type FileType(const char *name, bool is_dir)
+{
+	return is_dir ? FILE_TYPE_DIR :
+	       HasWadExtension(name) ? FILE_TYPE_WAD : FILE_TYPE_FILE;
+}
+
 static int OrderByName(const void *x, const void *y)
 {
 	const struct directory_entry *dx = x, *dy = y;
@@ -44,15 +144,305 @@ static int OrderByName(const void *x, const void *y)
 	return strcasecmp(dx->name, dy->name);
 }
 
+#ifdef __linux__
+
+static void FreeNames(char **names, size_t num_names)
+{
+	size_t i;
+
+	for (i = 0; i < num_names; i++) {
+		free(names[i]);
+	}
+	free(names);
+}
+
+static void SetSymlink(struct real_directory *d, const char *name,
+                       bool is_link)
+{
+	size_t i;
+
+	for (i = 0; i < d->num_symlink_names; i++) {
+		if (!strcmp(d->symlink_names[i], name)) {
+			break;
+		}
+	}
+	if (is_link && i == d->num_symlink_names) {
+		d->symlink_names = checked_realloc(d->symlink_names,
+			(d->num_symlink_names + 1) * sizeof(char *));
+		d->symlink_names[i] = checked_strdup(name);
+		++d->num_symlink_names;
+	} else if (!is_link && i < d->num_symlink_names) {
+		free(d->symlink_names[i]);
+		--d->num_symlink_names;
+		d->symlink_names[i] = d->symlink_names[d->num_symlink_names];
+	}
+}
+
+static void FreeStatJob(struct stat_job *job)
+{
+	free(job->path);
+	free(job->names);
+	free(job->name_offsets);
+	free(job->results);
+	free(job);
+}
+
+static void WakeMainThread(void)
+{
+	uint64_t one = 1;
+	(void) !write(wakeup_fd, &one, sizeof(one));
+}
+
+static void RunStatJob(struct stat_job *job)
+{
+	struct stat_result *r;
+	const char *name;
+	struct stat s;
+	bool stat_ok;
+	size_t i;
+	int fd;
+
+	fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	for (i = 0; i < job->num_names; i++) {
+		name = job->names + job->name_offsets[i];
+		stat_ok = fd >= 0 && fstatat(fd, name, &s, 0) == 0;
+
+		pthread_mutex_lock(&stat_lock);
+		if (job->cancelled) {
+			pthread_mutex_unlock(&stat_lock);
+			break;
+		}
+		r = &job->results[job->num_results];
+		r->name_index = i;
+		r->size = stat_ok ? s.st_size : -1;
+		++job->num_results;
+		pthread_mutex_unlock(&stat_lock);
+
+		if ((i + 1) % STAT_WAKEUP_INTERVAL == 0) {
+			WakeMainThread();
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static void *StatThread(void *unused)
+{
+	struct stat_job *job;
+
+	pthread_mutex_lock(&stat_lock);
+	for (;;) {
+		while (stat_queue == NULL) {
+			pthread_cond_wait(&stat_cond, &stat_lock);
+		}
+		job = stat_queue;
+		stat_queue = job->next;
+		job->running = true;
+		pthread_mutex_unlock(&stat_lock);
+
+		RunStatJob(job);
+
+		pthread_mutex_lock(&stat_lock);
+		job->running = false;
+		job->done = true;
+		// If the directory was closed or reread in the meantime,
+		// nobody else refers to the job any more.
+		if (job->cancelled) {
+			FreeStatJob(job);
+		} else {
+			WakeMainThread();
+		}
+	}
+
+	return NULL;
+}
+
+static void AddToStatJob(struct real_directory *d, const char *name)
+{
+	struct stat_job *job = d->stat_job;
+	size_t len = strlen(name) + 1;
+
+	if (job == NULL) {
+		job = checked_calloc(1, sizeof(struct stat_job));
+		job->path = checked_strdup(d->dir.path);
+		d->stat_job = job;
+	}
+	if (job->names_len + len > job->names_size) {
+		job->names_size = max(job->names_size * 2,
+		                      job->names_len + len + 4096);
+		job->names = checked_realloc(job->names, job->names_size);
+	}
+	if ((job->num_names & (job->num_names - 1)) == 0) {
+		job->name_offsets = checked_realloc(job->name_offsets,
+			max(job->num_names * 2, 1) * sizeof(size_t));
+	}
+	memcpy(job->names + job->names_len, name, len);
+	job->name_offsets[job->num_names] = job->names_len;
+	job->names_len += len;
+	++job->num_names;
+}
+
+static void StartStatJob(struct real_directory *d)
+{
+	struct stat_job *job = d->stat_job, **j;
+	pthread_t thread;
+
+	if (job == NULL) {
+		return;
+	}
+	job->results = checked_calloc(job->num_names,
+	                              sizeof(struct stat_result));
+
+	pthread_mutex_lock(&stat_lock);
+	if (!stat_thread_started) {
+		stat_thread_started =
+			pthread_create(&thread, NULL, StatThread, NULL) == 0;
+		if (stat_thread_started) {
+			pthread_detach(thread);
+		}
+	}
+	if (!stat_thread_started) {
+		// We'll just have to do it ourselves. The results still only
+		// get applied from RealDirChanges, so wake the main loop.
+		pthread_mutex_unlock(&stat_lock);
+		RunStatJob(job);
+		job->done = true;
+		WakeMainThread();
+		return;
+	}
+	for (j = &stat_queue; *j != NULL; j = &(*j)->next);
+	*j = job;
+	pthread_cond_signal(&stat_cond);
+	pthread_mutex_unlock(&stat_lock);
+}
+
+static void CancelStatJob(struct real_directory *d)
+{
+	struct stat_job *job = d->stat_job, **j;
+
+	if (job == NULL) {
+		return;
+	}
+	d->stat_job = NULL;
+
+	pthread_mutex_lock(&stat_lock);
+	if (job->running) {
+		// The thread will free it when it notices.
+		job->cancelled = true;
+		pthread_mutex_unlock(&stat_lock);
+		return;
+	}
+	for (j = &stat_queue; *j != NULL; j = &(*j)->next) {
+		if (*j == job) {
+			*j = job->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stat_lock);
+	FreeStatJob(job);
+}
+
+// Fills in the sizes of any files that the background thread has got to
+// since last time. A size that is already known must have come from a
+// change that we were told about, and so is newer; likewise, any changes
+// are only read after this.
+static void ApplyStatResults(struct real_directory *d)
+{
+	struct stat_job *job = d->stat_job;
+	struct directory_entry *ent;
+	struct stat_result *r;
+	size_t num_results;
+	bool done;
+
+	if (job == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&stat_lock);
+	num_results = job->num_results;
+	done = job->done;
+	pthread_mutex_unlock(&stat_lock);
+
+	for (; job->num_applied < num_results; ++job->num_applied) {
+		r = &job->results[job->num_applied];
+		ent = VFS_EntryByName(&d->dir, job->names
+			+ job->name_offsets[r->name_index]);
+		if (ent != NULL && ent->type != FILE_TYPE_DIR
+		 && ent->size < 0) {
+			ent->size = r->size;
+		}
+	}
+
+	if (done) {
+		FreeStatJob(job);
+		d->stat_job = NULL;
+	}
+}
+
+#endif
+
+// Fills in the type and size of a new entry. Whenever we can, we go by
+// the type in the dirent, since stat() can be slow, and in a watched
+// directory we leave most of the file sizes to the background thread.
+static void ReadEntryInfo(struct real_directory *d, DIR *dir,
+                          struct dirent *dirent,
+                          struct directory_entry *ent,
+                          unsigned int *num_stats)
+{
+	struct stat s;
+	bool stat_ok;
+
+#ifdef __linux__
+	if (dirent->d_type == DT_DIR) {
+		ent->type = FILE_TYPE_DIR;
+		ent->size = -1;
+		return;
+	} else if (dirent->d_type == DT_REG && d->watch >= 0
+	        && wakeup_fd >= 0 && *num_stats >= SYNC_STAT_LIMIT) {
+		ent->type = FileType(ent->name, false);
+		ent->size = -1;
+		AddToStatJob(d, ent->name);
+		return;
+	}
+	if (dirent->d_type == DT_LNK
+	 || (dirent->d_type == DT_UNKNOWN
+	  && fstatat(dirfd(dir), dirent->d_name, &s,
+	             AT_SYMLINK_NOFOLLOW) == 0
+	  && S_ISLNK(s.st_mode))) {
+		SetSymlink(d, ent->name, true);
+	}
+#endif
+	// We stat() the file, which resolves symlinks and gives
+	// additional information such as file size and type
+	// (in a portable way)
+	stat_ok = fstatat(dirfd(dir), dirent->d_name, &s, 0) == 0;
+	ent->type = FileType(ent->name, stat_ok && S_ISDIR(s.st_mode));
+	ent->size = stat_ok && ent->type != FILE_TYPE_DIR ? s.st_size : -1;
+	++*num_stats;
+}
+
 static bool _RealDirRefresh(struct directory *d,
                             struct directory_entry **entries,
-                            size_t *num_entries)
+                            size_t *num_entries, struct entry_names **names)
 {
+	struct real_directory *rd = (struct real_directory *) d;
+	unsigned int num_stats = 0;
+	size_t entries_size = 0;
 	DIR *dir;
 
 	*entries = NULL;
 	*num_entries = 0;
 
+#ifdef __linux__
+	FreeNames(rd->symlink_names, rd->num_symlink_names);
+	rd->symlink_names = NULL;
+	rd->num_symlink_names = 0;
+	CancelStatJob(rd);
+#endif
+
 	dir = opendir(d->path);
 	if (dir == NULL) {
 		return false;
@@ -61,9 +451,7 @@ static bool _RealDirRefresh(struct directory *d,
 	for (;;) {
 		struct dirent *dirent = readdir(dir);
 		struct directory_entry *ent;
-		struct stat s;
-		bool stat_ok;
-		char *path;
+		size_t len;
 
 		if (dirent == NULL) {
 			break;
@@ -71,28 +459,25 @@ static bool _RealDirRefresh(struct directory *d,
 		if (dirent->d_name[0] == '.') {
 			continue;
 		}
-		path = StringJoin("/", d->path, dirent->d_name, NULL);
-		// We stat() the file, which resolves symlinks and gives
-		// additional information such as file size and type
-		// (in a portable way)
-		stat_ok = stat(path, &s) == 0;
-		free(path);
-		path = checked_strdup(dirent->d_name);
 
-		*entries = checked_realloc(*entries,
-			sizeof(struct directory_entry) * (*num_entries + 1));
+		if (*num_entries >= entries_size) {
+			entries_size = max(entries_size * 2, 64);
+			*entries = checked_realloc(*entries,
+				sizeof(struct directory_entry) * entries_size);
+		}
 		ent = *entries + *num_entries;
-		ent->name = path;
-		ent->type = stat_ok && S_ISDIR(s.st_mode) ? FILE_TYPE_DIR :
-		            HasWadExtension(ent->name) ? FILE_TYPE_WAD :
-		            FILE_TYPE_FILE;
-		ent->size = stat_ok
-		         && ent->type != FILE_TYPE_DIR ? s.st_size : -1;
+		len = strlen(dirent->d_name);
+		ent->name = VFS_AllocEntryName(names, len);
+		memcpy(ent->name, dirent->d_name, len);
+		ReadEntryInfo(rd, dir, dirent, ent, &num_stats);
 		ent->serial_no = dirent->d_ino;
 		++*num_entries;
 	}
 
 	closedir(dir);
+#ifdef __linux__
+	StartStatJob(rd);
+#endif
 
 	qsort(*entries, *num_entries, sizeof(struct directory_entry),
 	      OrderByName);
@@ -100,15 +485,463 @@ static bool _RealDirRefresh(struct directory *d,
 }
 
 static void RealDirRefresh(void *d, struct directory_entry **entries,
-                           size_t *num_entries)
+                           size_t *num_entries, struct entry_names **names)
+{
+	(void) _RealDirRefresh(d, entries, num_entries, names);
+}
+
+#ifdef __linux__
+
+static void FreeChanges(struct real_directory *d)
 {
-	(void) _RealDirRefresh(d, entries, num_entries);
+	FreeNames(d->refresh_names, d->num_refresh_names);
+	free(d->changed);
+	d->refresh_names = NULL;
+	d->num_refresh_names = 0;
+	d->changed = NULL;
+	d->num_changed = 0;
 }
 
+static void AddChangedName(struct real_directory *d, const char *name)
+{
+	size_t i;
+
+	if (d->rescan || name[0] == '.') {
+		return;
+	}
+	for (i = 0; i < d->num_changed_names; i++) {
+		if (!strcmp(d->changed_names[i], name)) {
+			return;
+		}
+	}
+	if (d->num_changed_names >= MAX_CHANGED_NAMES) {
+		d->rescan = true;
+		return;
+	}
+	d->changed_names = checked_realloc(d->changed_names,
+		(d->num_changed_names + 1) * sizeof(char *));
+	d->changed_names[d->num_changed_names] = checked_strdup(name);
+	++d->num_changed_names;
+}
+
+static void HandleEvent(const struct inotify_event *ev)
+{
+	struct real_directory *d;
+
+	for (d = watched_dirs; d != NULL; d = d->next_watched) {
+		if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+			d->rescan = true;
+		} else if (d->watch != ev->wd) {
+			continue;
+		} else if ((ev->mask & (IN_IGNORED | IN_DELETE_SELF
+		                      | IN_MOVE_SELF)) != 0) {
+			// The watch is gone, so from now on we can't
+			// know what changed.
+			d->rescan = true;
+			d->watch = -1;
+		} else if (ev->len > 0) {
+			AddChangedName(d, ev->name);
+		}
+	}
+}
+
+// Reads all pending events from the kernel and records them against the
+// directories that they apply to.
+void VFS_ReadWatchEvents(void)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t len, i;
+	uint64_t wakeups;
+
+	if (inotify_fd < 0) {
+		return;
+	}
+	if (wakeup_fd >= 0) {
+		(void) !read(wakeup_fd, &wakeups, sizeof(wakeups));
+	}
+
+	while ((len = read(inotify_fd, u.buf, sizeof(u.buf))) > 0) {
+		for (i = 0; i < len; i += sizeof(struct inotify_event)
+		                          + ev->len) {
+			ev = (const struct inotify_event *) (u.buf + i);
+			HandleEvent(ev);
+		}
+	}
+}
+
+int VFS_WatchDescriptor(void)
+{
+	struct epoll_event ev = {EPOLLIN};
+	int epoll_fd;
+
+	if (inotify_fd >= 0) {
+		return watch_fd;
+	}
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		return -1;
+	}
+	watch_fd = inotify_fd;
+
+	// If we can't be woken up by the background thread, we just won't
+	// use it.
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (wakeup_fd >= 0 && epoll_fd >= 0
+	 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) == 0
+	 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) == 0) {
+		watch_fd = epoll_fd;
+		return watch_fd;
+	}
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+	}
+	if (wakeup_fd >= 0) {
+		close(wakeup_fd);
+		wakeup_fd = -1;
+	}
+	return watch_fd;
+}
+
+// Filesystems where files can be changed by other machines without the
+// kernel knowing, so inotify would miss the changes. Directories on them
+// are not watched, and so are reread in full on every refresh.
+static const uint32_t remote_fs_types[] = {
+	0x00006969,  // NFS
+	0x0000517b,  // SMB
+	0xff534d42,  // CIFS
+	0xfe534d42,  // SMB2
+	0x65735546,  // FUSE (sshfs, etc.)
+	0x73757245,  // Coda
+	0x5346414f,  // AFS
+	0x01021997,  // 9P
+	0x00c36400,  // Ceph
+};
+
+static bool IsRemoteFilesystem(const char *path)
+{
+	struct statfs fs;
+	int i;
+
+	if (statfs(path, &fs) != 0) {
+		return false;
+	}
+	for (i = 0; i < arrlen(remote_fs_types); i++) {
+		if ((uint32_t) fs.f_type == remote_fs_types[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void WatchDirectory(struct real_directory *d)
+{
+	d->watch = -1;
+	if (IsRemoteFilesystem(d->dir.path) || VFS_WatchDescriptor() < 0) {
+		return;
+	}
+	d->watch = inotify_add_watch(inotify_fd, d->dir.path, WATCH_EVENTS);
+	d->next_watched = watched_dirs;
+	watched_dirs = d;
+}
+
+static void UnwatchDirectory(struct real_directory *d)
+{
+	struct real_directory **r, *d2;
+
+	for (r = &watched_dirs; *r != NULL; r = &(*r)->next_watched) {
+		if (*r == d) {
+			*r = d->next_watched;
+			break;
+		}
+	}
+	// The same directory may be open under two different paths, in
+	// which case it will have the same watch descriptor.
+	for (d2 = watched_dirs; d2 != NULL; d2 = d2->next_watched) {
+		if (d2->watch == d->watch) {
+			return;
+		}
+	}
+	if (d->watch >= 0) {
+		inotify_rm_watch(inotify_fd, d->watch);
+	}
+}
+
+// Fills in the entry for the given name, and returns false if there is no
+// longer anything with that name.
+static bool ReadEntry(struct real_directory *d, const char *name,
+                      struct directory_entry *ent, bool *is_link)
+{
+	char *path = StringJoin("/", d->dir.path, name, NULL);
+	struct stat s;
+	bool stat_ok;
+	ino_t ino;
+
+	// As in _RealDirRefresh, the serial number is the inode number of
+	// the directory entry itself, not what it links to.
+	if (lstat(path, &s) != 0) {
+		free(path);
+		*is_link = false;
+		return false;
+	}
+	*is_link = S_ISLNK(s.st_mode);
+	ino = s.st_ino;
+	stat_ok = !S_ISLNK(s.st_mode) || stat(path, &s) == 0;
+	free(path);
+
+	ent->name = (char *) name;
+	ent->type = FileType(name, stat_ok && S_ISDIR(s.st_mode));
+	ent->size = stat_ok && ent->type != FILE_TYPE_DIR ? s.st_size : -1;
+	ent->serial_no = ino;
+	return true;
+}
+
+static bool StatEntry(struct real_directory *d, const char *name,
+                      struct directory_entry *ent)
+{
+	bool is_link, result;
+
+	result = ReadEntry(d, name, ent, &is_link);
+	SetSymlink(d, name, is_link);
+	return result;
+}
+
+// Symlinks are checked on every refresh, but only count as changed if
+// what they point to now looks different.
+static bool SymlinkChanged(struct real_directory *d, const char *name)
+{
+	struct directory_entry *old = VFS_EntryByName(&d->dir, name), ent;
+	bool is_link;
+
+	return old == NULL || !ReadEntry(d, name, &ent, &is_link) || !is_link
+	    || ent.type != old->type || ent.size != old->size
+	    || ent.serial_no != old->serial_no;
+}
+
+static unsigned int CountBelow(const unsigned int *sorted, size_t cnt,
+                               unsigned int index)
+{
+	size_t i;
+
+	for (i = 0; i < cnt && sorted[i] < index; i++);
+	return i;
+}
+
+// Index of the first entry that does not sort before the given one.
+static unsigned int LowerBound(struct directory *dir,
+                               const struct directory_entry *ent)
+{
+	unsigned int lo = 0, hi = dir->num_entries, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (OrderByName(&dir->entries[mid], ent) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int OrderInserts(const void *x, const void *y)
+{
+	const struct changed_entry *cx = x, *cy = y;
+
+	if (cx->index != cy->index) {
+		return cx->index < cy->index ? -1 : 1;
+	}
+	return OrderByName(&cx->ent, &cy->ent);
+}
+
+static int OrderIndexes(const void *x, const void *y)
+{
+	const unsigned int *ix = x, *iy = y;
+	return (*ix > *iy) - (*ix < *iy);
+}
+
+static void AddChange(struct real_directory *d, size_t *num_changes,
+                      enum directory_change_type type, unsigned int index)
+{
+	if (*num_changes >= d->changes_size) {
+		d->changes_size = max(d->changes_size * 2, 16);
+		d->changes = checked_realloc(d->changes,
+			d->changes_size * sizeof(struct directory_change));
+	}
+	d->changes[*num_changes].type = type;
+	d->changes[*num_changes].index = index;
+	d->changes[*num_changes].count = 1;
+	++*num_changes;
+}
+
+// Works out how the changed names affect the sorted list of entries. Any
+// entries that no longer exist, or that changed between file and
+// directory (which moves them), are removed first, in descending order so
+// that the indexes of the others are not disturbed. Then the entries that
+// were modified in place, then the new ones, in ascending order.
+static size_t BuildChanges(struct real_directory *d)
+{
+	struct changed_entry *inserts, *modifies;
+	size_t i, j, num_inserts = 0, num_modifies = 0, num_removes = 0;
+	size_t num_changes = 0;
+	struct directory_entry *old, ent;
+	unsigned int *removes, idx;
+
+	inserts = checked_calloc(d->num_changed_names + 1,
+	                         sizeof(struct changed_entry));
+	modifies = checked_calloc(d->num_changed_names + 1,
+	                          sizeof(struct changed_entry));
+	removes = checked_calloc(d->num_changed_names + 1,
+	                         sizeof(unsigned int));
+
+	for (i = 0; i < d->num_changed_names; i++) {
+		const char *name = d->changed_names[i];
+		bool exists = StatEntry(d, name, &ent);
+
+		old = VFS_EntryByName(&d->dir, name);
+		if (old != NULL && exists
+		 && (old->type == FILE_TYPE_DIR)
+		 == (ent.type == FILE_TYPE_DIR)) {
+			modifies[num_modifies].index = old - d->dir.entries;
+			modifies[num_modifies].ent = ent;
+			++num_modifies;
+			continue;
+		}
+		if (old != NULL) {
+			removes[num_removes] = old - d->dir.entries;
+			++num_removes;
+		}
+		if (exists) {
+			inserts[num_inserts].index = LowerBound(&d->dir, &ent);
+			inserts[num_inserts].ent = ent;
+			++num_inserts;
+		}
+	}
+
+	qsort(removes, num_removes, sizeof(unsigned int), OrderIndexes);
+	for (i = num_removes; i > 0; i--) {
+		AddChange(d, &num_changes, VFS_CHANGE_REMOVE, removes[i - 1]);
+	}
+
+	// Indexes of inserts are now relative to the list without the
+	// removed entries, and end up shifted by the inserts before them.
+	for (i = 0; i < num_inserts; i++) {
+		inserts[i].index -= CountBelow(removes, num_removes,
+		                               inserts[i].index);
+	}
+	qsort(inserts, num_inserts, sizeof(struct changed_entry),
+	      OrderInserts);
+
+	for (i = 0; i < num_modifies; i++) {
+		idx = modifies[i].index;
+		idx -= CountBelow(removes, num_removes, idx);
+		AddChange(d, &num_changes, VFS_CHANGE_MODIFY, idx);
+		for (j = 0; j < num_inserts && inserts[j].index <= idx; j++);
+		modifies[i].index = idx + j;
+	}
+	for (i = 0; i < num_inserts; i++) {
+		inserts[i].index += i;
+		AddChange(d, &num_changes, VFS_CHANGE_INSERT,
+		          inserts[i].index);
+	}
+
+	d->changed = checked_realloc(inserts,
+		(num_inserts + num_modifies + 1)
+		  * sizeof(struct changed_entry));
+	memcpy(d->changed + num_inserts, modifies,
+	       num_modifies * sizeof(struct changed_entry));
+	d->num_changed = num_inserts + num_modifies;
+	free(modifies);
+	free(removes);
+
+	return num_changes;
+}
+
+static bool RealDirChanges(void *_dir, const struct directory_change **changes,
+                           size_t *num_changes)
+{
+	struct real_directory *d = _dir;
+	size_t i;
+
+	FreeChanges(d);
+	VFS_ReadWatchEvents();
+	ApplyStatResults(d);
+	for (i = 0; i < d->num_symlink_names; i++) {
+		if (SymlinkChanged(d, d->symlink_names[i])) {
+			AddChangedName(d, d->symlink_names[i]);
+		}
+	}
+
+	if (d->watch < 0 || d->rescan) {
+		FreeNames(d->changed_names, d->num_changed_names);
+		d->changed_names = NULL;
+		d->num_changed_names = 0;
+		d->rescan = false;
+		return false;
+	}
+
+	*num_changes = BuildChanges(d);
+	*changes = d->changes;
+	d->refresh_names = d->changed_names;
+	d->num_refresh_names = d->num_changed_names;
+	d->changed_names = NULL;
+	d->num_changed_names = 0;
+
+	return true;
+}
+
+static void RealDirRefreshEntry(void *_dir, unsigned int index,
+                                struct directory_entry *entry,
+                                struct entry_names **names)
+{
+	struct real_directory *d = _dir;
+	size_t i, len;
+
+	for (i = 0; i < d->num_changed; i++) {
+		if (d->changed[i].index == index) {
+			*entry = d->changed[i].ent;
+			len = strlen(entry->name);
+			entry->name = VFS_AllocEntryName(names, len);
+			memcpy(entry->name, d->changed[i].ent.name, len);
+			return;
+		}
+	}
+}
+
+static void RealDirFree(void *_dir)
+{
+	struct real_directory *d = _dir;
+
+	UnwatchDirectory(d);
+	CancelStatJob(d);
+	FreeChanges(d);
+	FreeNames(d->changed_names, d->num_changed_names);
+	FreeNames(d->symlink_names, d->num_symlink_names);
+	free(d->changes);
+}
+
+#else
+
+void VFS_ReadWatchEvents(void)
+{
+}
+
+int VFS_WatchDescriptor(void)
+{
+	return -1;
+}
+
+#endif
+
 static VFILE *RealDirOpen(void *_dir, struct directory_entry *entry)
 {
 	struct directory *dir = _dir;
 	char *filename = VFS_EntryPath(dir, entry);
+	VFILE *result;
 	FILE *fs;
 
 	fs = fopen(filename, "r+");
@@ -118,8 +951,10 @@ static VFILE *RealDirOpen(void *_dir, struct directory_entry *entry)
 		return NULL;
 	}
 
+	result = vfwrapfile(fs);
+	vfsetname(result, filename);
 	free(filename);
-	return vfwrapfile(fs);
+	return result;
 }
 
 struct directory *RealDirOpenDir(void *_dir, struct directory_entry *entry)
@@ -185,12 +1020,20 @@ static const struct directory_funcs realdir_funcs = {
 	NULL,  // swap_entries
 	NULL,  // save_snapshot
 	NULL,  // restore_snapshot
+#ifdef __linux__
+	RealDirFree,
+	RealDirChanges,
+	RealDirRefreshEntry,
+#else
 	NULL,  // free
+#endif
 };
 
 struct directory *VFS_OpenRealDir(const char *path)
 {
-	struct directory *d = checked_calloc(1, sizeof(struct directory));
+	struct real_directory *rd =
+		checked_calloc(1, sizeof(struct real_directory));
+	struct directory *d = &rd->dir;
 
 	d->directory_funcs = &realdir_funcs;
 	VFS_InitDirectory(d, path);
@@ -199,7 +1042,13 @@ struct directory *VFS_OpenRealDir(const char *path)
 		free(d->parent_name);
 		d->parent_name = NULL;
 	}
-	if (!_RealDirRefresh(d, &d->entries, &d->num_entries)) {
+#ifdef __linux__
+	// The watch is added first, so that we don't miss any changes made
+	// while the directory is being read.
+	WatchDirectory(rd);
+#endif
+	if (!_RealDirRefresh(d, &d->entries, &d->num_entries,
+	                     &d->entry_names)) {
 		VFS_CloseDir(d);
 		return NULL;
 	}
@@ -212,6 +1061,8 @@ VFILE *VFS_Open(const char *path)
 	VFILE *result = vfwrapfile(fopen(path, "r+"));
 	if (result == NULL) {
 		VFS_StoreError("%s: %s", path, strerror(errno));
+	} else {
+		vfsetname(result, path);
 	}
 	return result;
 }
@@ -8,12 +8,21 @@
 // of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE  // for copy_file_range()
+#endif
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "common.h"
 #include "fs/vfile.h"
 
@@ -68,6 +77,25 @@ size_t vfwrite(const void *ptr, size_t size, size_t nitems, VFILE *stream)
 	return stream->functions->write(ptr, size, nitems, stream->handle);
 }
 
+bool vfcanpread(VFILE *stream)
+{
+	return stream->functions->pread != NULL
+	    && stream->functions->pwrite != NULL;
+}
+
+// No SwitchSavedPos() needed here, as the current position is not used.
+size_t vfpread(void *ptr, size_t len, long offset, VFILE *stream)
+{
+	assert(vfcanpread(stream));
+	return stream->functions->pread(ptr, len, offset, stream->handle);
+}
+
+size_t vfpwrite(const void *ptr, size_t len, long offset, VFILE *stream)
+{
+	assert(vfcanpread(stream));
+	return stream->functions->pwrite(ptr, len, offset, stream->handle);
+}
+
 void vftruncate(VFILE *stream)
 {
 	SwitchSavedPos(stream, true);
@@ -92,6 +120,15 @@ void vfsync(VFILE *stream)
 	stream->functions->sync(stream->handle);
 }
 
+void vfflush(VFILE *stream)
+{
+	if (stream->functions->flush == NULL) {
+		return;
+	}
+	SwitchSavedPos(stream, true);
+	stream->functions->flush(stream->handle);
+}
+
 void vfclose(VFILE *stream)
 {
 	SwitchSavedPos(stream, true);
@@ -145,6 +182,33 @@ static void wrapped_fclose(void *handle)
 	fclose(handle);
 }
 
+static void wrapped_fflush(void *handle)
+{
+	fflush(handle);
+}
+
+// Positional I/O goes straight to the file descriptor, so the stdio buffer
+// is flushed first: that writes out any pending data, and discards any
+// read-ahead that a pwrite() might make stale.
+static size_t wrapped_pread(void *ptr, size_t len, long offset, void *handle)
+{
+	ssize_t result;
+
+	fflush(handle);
+	result = pread(fileno((FILE *) handle), ptr, len, offset);
+	return result < 0 ? 0 : result;
+}
+
+static size_t wrapped_pwrite(const void *ptr, size_t len, long offset,
+                             void *handle)
+{
+	ssize_t result;
+
+	fflush(handle);
+	result = pwrite(fileno((FILE *) handle), ptr, len, offset);
+	return result < 0 ? 0 : result;
+}
+
 static struct vfile_functions wrapped_io_functions = {
 	wrapped_fread,
 	wrapped_fwrite,
@@ -153,17 +217,389 @@ static struct vfile_functions wrapped_io_functions = {
 	wrapped_ftruncate,
 	wrapped_fclose,
 	wrapped_fsync,
+	wrapped_fflush,
+	wrapped_pread,
+	wrapped_pwrite,
+};
+
+// I/O statistics: once enabled, every file opened with vfwrapfile() is
+// wrapped in an instrumented_vfile that counts the calls made through it.
+// Counts are kept per file, and also per operation (see vfsetoperation).
+
+struct vfile_stats {
+	unsigned long reads, writes, seeks, tells, truncates, syncs, flushes;
+	unsigned long copies;
+	unsigned long long read_bytes, write_bytes, copy_bytes;
 };
 
+struct io_operation {
+	const char *name;
+	struct vfile_stats stats;
+	struct io_operation *next;
+};
+
+struct instrumented_vfile {
+	VFILE *inner;
+	char *name;
+	struct vfile_stats stats;
+};
+
+static FILE *iostats_log;
+static struct io_operation *io_operations, *current_operation;
+
+#define COUNT_IO(instr, field, n) do { \
+		(instr)->stats.field += (n); \
+		current_operation->stats.field += (n); \
+	} while (0)
+
+static void PrintStats(const char *name, const struct vfile_stats *s)
+{
+	fprintf(iostats_log, "%s:\n"
+	        "  reads %lu (%llu bytes), writes %lu (%llu bytes), "
+	        "kernel copies %lu (%llu bytes)\n"
+	        "  seeks %lu, tells %lu, truncates %lu, syncs %lu, "
+	        "flushes %lu\n",
+	        name, s->reads, s->read_bytes, s->writes, s->write_bytes,
+	        s->copies, s->copy_bytes, s->seeks, s->tells, s->truncates,
+	        s->syncs, s->flushes);
+}
+
+static void DumpIOStats(void)
+{
+	struct io_operation *op;
+
+	fprintf(iostats_log, "\n--- Totals by operation ---\n");
+	for (op = io_operations; op != NULL; op = op->next) {
+		PrintStats(op->name, &op->stats);
+	}
+	fflush(iostats_log);
+}
+
+static size_t instrumented_vfread(void *ptr, size_t size, size_t nitems,
+                                  void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	size_t result = vfread(ptr, size, nitems, instr->inner);
+	COUNT_IO(instr, reads, 1);
+	COUNT_IO(instr, read_bytes, result * size);
+	return result;
+}
+
+static size_t instrumented_vfwrite(const void *ptr, size_t size,
+                                   size_t nitems, void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	size_t result = vfwrite(ptr, size, nitems, instr->inner);
+	COUNT_IO(instr, writes, 1);
+	COUNT_IO(instr, write_bytes, result * size);
+	return result;
+}
+
+static int instrumented_vfseek(void *handle, long offset, int whence)
+{
+	struct instrumented_vfile *instr = handle;
+	COUNT_IO(instr, seeks, 1);
+	return vfseek(instr->inner, offset, whence);
+}
+
+static long instrumented_vftell(void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	COUNT_IO(instr, tells, 1);
+	return vftell(instr->inner);
+}
+
+static void instrumented_vftruncate(void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	COUNT_IO(instr, truncates, 1);
+	vftruncate(instr->inner);
+}
+
+static void instrumented_vfsync(void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	COUNT_IO(instr, syncs, 1);
+	vfsync(instr->inner);
+}
+
+static void instrumented_vfflush(void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	COUNT_IO(instr, flushes, 1);
+	vfflush(instr->inner);
+}
+
+static void instrumented_vfclose(void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+
+	PrintStats(instr->name, &instr->stats);
+	vfclose(instr->inner);
+	free(instr->name);
+	free(instr);
+}
+
+static size_t instrumented_pread(void *ptr, size_t len, long offset,
+                                 void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	size_t result = vfpread(ptr, len, offset, instr->inner);
+	COUNT_IO(instr, reads, 1);
+	COUNT_IO(instr, read_bytes, result);
+	return result;
+}
+
+static size_t instrumented_pwrite(const void *ptr, size_t len, long offset,
+                                  void *handle)
+{
+	struct instrumented_vfile *instr = handle;
+	size_t result = vfpwrite(ptr, len, offset, instr->inner);
+	COUNT_IO(instr, writes, 1);
+	COUNT_IO(instr, write_bytes, result);
+	return result;
+}
+
+static struct vfile_functions instrumented_io_functions = {
+	instrumented_vfread,
+	instrumented_vfwrite,
+	instrumented_vfseek,
+	instrumented_vftell,
+	instrumented_vftruncate,
+	instrumented_vfclose,
+	instrumented_vfsync,
+	instrumented_vfflush,
+	instrumented_pread,
+	instrumented_pwrite,
+};
+
+void vfenableiostats(FILE *log)
+{
+	assert(iostats_log == NULL);
+	iostats_log = log;
+	vfsetoperation(NULL);
+	atexit(DumpIOStats);
+}
+
+const char *vfsetoperation(const char *name)
+{
+	struct io_operation *op;
+	const char *result;
+
+	if (iostats_log == NULL) {
+		return NULL;
+	}
+	result = current_operation != NULL ? current_operation->name : NULL;
+	if (name == NULL) {
+		name = "(other)";
+	}
+
+	for (op = io_operations; op != NULL; op = op->next) {
+		if (!strcmp(op->name, name)) {
+			current_operation = op;
+			return result;
+		}
+	}
+
+	op = checked_calloc(1, sizeof(struct io_operation));
+	op->name = name;
+	op->next = io_operations;
+	io_operations = op;
+	current_operation = op;
+
+	return result;
+}
+
+void vfsetname(VFILE *stream, const char *name)
+{
+	struct instrumented_vfile *instr = stream->handle;
+
+	if (stream->functions == &instrumented_io_functions) {
+		free(instr->name);
+		instr->name = checked_strdup(name);
+	}
+}
+
+// Slow storage simulation: if enabled, every file opened with vfwrapfile()
+// is wrapped in a slow_vfile that delays each operation as configured, to
+// roughly imitate a network filesystem or a spinning disk.
+
+struct slow_vfile {
+	VFILE *inner;
+	// Position of the stream, and where the last transfer ended.
+	long pos, head;
+};
+
+static struct vfile_slowio slowio;
+static bool slowio_enabled;
+// Delays are accumulated and only slept once they add up to something
+// worth sleeping for, since short sleeps are very imprecise.
+static unsigned long long slowio_owed_nsec;
+
+static void SlowDelay(unsigned long long nsec)
+{
+	struct timespec ts;
+
+	slowio_owed_nsec += nsec;
+	if (slowio_owed_nsec < 1000000) {
+		return;
+	}
+
+	ts.tv_sec = slowio_owed_nsec / 1000000000;
+	ts.tv_nsec = slowio_owed_nsec % 1000000000;
+	slowio_owed_nsec = 0;
+	nanosleep(&ts, NULL);
+}
+
+// Delays for a transfer of len bytes at the given offset.
+static void SlowTransfer(struct slow_vfile *s, long offset, size_t len)
+{
+	if (offset != s->head) {
+		SlowDelay(slowio.seek_usec * 1000ULL);
+	}
+	SlowDelay(len * slowio.usec_per_kb * 1000ULL / 1024);
+	s->head = offset + len;
+}
+
+static size_t slow_vfread(void *ptr, size_t size, size_t nitems,
+                          void *handle)
+{
+	struct slow_vfile *s = handle;
+	size_t result;
+
+	SlowTransfer(s, s->pos, size * nitems);
+	result = vfread(ptr, size, nitems, s->inner);
+	s->pos += result * size;
+	return result;
+}
+
+static size_t slow_vfwrite(const void *ptr, size_t size,
+                           size_t nitems, void *handle)
+{
+	struct slow_vfile *s = handle;
+	size_t result;
+
+	SlowTransfer(s, s->pos, size * nitems);
+	result = vfwrite(ptr, size, nitems, s->inner);
+	s->pos += result * size;
+	return result;
+}
+
+static int slow_vfseek(void *handle, long offset, int whence)
+{
+	struct slow_vfile *s = handle;
+	int result = vfseek(s->inner, offset, whence);
+
+	// The delay for seeking is charged by the next read or write, if it
+	// doesn't happen where the last one ended.
+	s->pos = vftell(s->inner);
+	return result;
+}
+
+static long slow_vftell(void *handle)
+{
+	struct slow_vfile *s = handle;
+	return s->pos;
+}
+
+static void slow_vftruncate(void *handle)
+{
+	struct slow_vfile *s = handle;
+	SlowDelay(slowio.sync_usec * 1000ULL);
+	vftruncate(s->inner);
+}
+
+static void slow_vfsync(void *handle)
+{
+	struct slow_vfile *s = handle;
+	SlowDelay(slowio.sync_usec * 1000ULL);
+	vfsync(s->inner);
+}
+
+static void slow_vfflush(void *handle)
+{
+	struct slow_vfile *s = handle;
+	vfflush(s->inner);
+}
+
+static void slow_vfclose(void *handle)
+{
+	struct slow_vfile *s = handle;
+	vfclose(s->inner);
+	free(s);
+}
+
+static size_t slow_pread(void *ptr, size_t len, long offset, void *handle)
+{
+	struct slow_vfile *s = handle;
+
+	SlowTransfer(s, offset, len);
+	return vfpread(ptr, len, offset, s->inner);
+}
+
+static size_t slow_pwrite(const void *ptr, size_t len, long offset,
+                          void *handle)
+{
+	struct slow_vfile *s = handle;
+
+	SlowTransfer(s, offset, len);
+	return vfpwrite(ptr, len, offset, s->inner);
+}
+
+static struct vfile_functions slow_io_functions = {
+	slow_vfread,
+	slow_vfwrite,
+	slow_vfseek,
+	slow_vftell,
+	slow_vftruncate,
+	slow_vfclose,
+	slow_vfsync,
+	slow_vfflush,
+	slow_pread,
+	slow_pwrite,
+};
+
+void vfsimulateslowio(const struct vfile_slowio *config)
+{
+	slowio = *config;
+	slowio_enabled = true;
+}
+
+bool vfslowio(void)
+{
+	return slowio_enabled;
+}
+
 VFILE *vfwrapfile(FILE *stream)
 {
+	struct instrumented_vfile *instr;
+	struct slow_vfile *slow;
+	VFILE *result;
+
 	// We pass through NULL as a convenience. This allows constructions
 	// like `vfwrapfile(fopen("foo", "r"))` without needing to check the
 	// result from `fopen` first.
 	if (stream == NULL) {
 		return NULL;
 	}
-	return vfopen(stream, &wrapped_io_functions);
+	result = vfopen(stream, &wrapped_io_functions);
+
+	if (slowio_enabled) {
+		slow = checked_calloc(1, sizeof(struct slow_vfile));
+		slow->inner = result;
+		slow->pos = ftell(stream);
+		slow->head = -1;
+		result = vfopen(slow, &slow_io_functions);
+	}
+
+	if (iostats_log != NULL) {
+		instr = checked_calloc(1, sizeof(struct instrumented_vfile));
+		instr->inner = result;
+		instr->name = checked_strdup("(unnamed file)");
+		result = vfopen(instr, &instrumented_io_functions);
+	}
+
+	return result;
 }
 
 VFILE_CONTEXT *vfswitchcontext(VFILE *f, VFILE_CONTEXT *ctx)
@@ -180,18 +616,27 @@ struct restricted_vfile {
 	int ro;
 };
 
-static size_t restricted_vfread(void *ptr, size_t size, size_t nitems, void *handle)
+// Clamps a read/write of nitems at the given offset within the slice.
+static size_t RestrictedItems(struct restricted_vfile *restricted,
+                              long offset, size_t size, size_t nitems)
 {
-	struct restricted_vfile *restricted = handle;
-	size_t nreadable, result;
+	size_t navail;
 
 	if (restricted->end >= 0) {
-		size_t len = restricted->end - restricted->start;
-		nreadable = (len - restricted->pos) / size;
-		if (nitems > nreadable) {
-			nitems = nreadable;
+		navail = (restricted->end - restricted->start - offset) / size;
+		if (nitems > navail) {
+			nitems = navail;
 		}
 	}
+	return nitems;
+}
+
+static size_t restricted_vfread(void *ptr, size_t size, size_t nitems, void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	size_t result;
+
+	nitems = RestrictedItems(restricted, restricted->pos, size, nitems);
 	if (nitems == 0) {
 		return 0;
 	}
@@ -210,19 +655,13 @@ static size_t restricted_fwrite(const void *ptr, size_t size,
                                 size_t nitems, void *handle)
 {
 	struct restricted_vfile *restricted = handle;
-	size_t nwriteable, result;
+	size_t result;
 
 	if (restricted->ro) {
 		return -1;
 	}
 
-	if (restricted->end >= 0) {
-		nwriteable = (restricted->end - restricted->start
-		            - restricted->pos) / size;
-		if (nitems > nwriteable) {
-			nitems = nwriteable;
-		}
-	}
+	nitems = RestrictedItems(restricted, restricted->pos, size, nitems);
 	if (nitems == 0) {
 		return 0;
 	}
@@ -258,6 +697,7 @@ static int restricted_vfseek(void *handle, long offset, int whence)
 		return -1;
 	}
 
+	restricted->pos = offset;
 	return 0;
 }
 
@@ -280,6 +720,13 @@ static void restricted_vfsync(void *handle)
 		vfsync(restricted->inner));
 }
 
+static void restricted_vfflush(void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	WITH_VFCONTEXT(restricted->inner, &restricted->ctx,
+		vfflush(restricted->inner));
+}
+
 static void restricted_vfclose(void *handle)
 {
 	struct restricted_vfile *restricted = handle;
@@ -297,6 +744,125 @@ static struct vfile_functions restricted_io_functions = {
 	restricted_vftruncate,
 	restricted_vfclose,
 	restricted_vfsync,
+	restricted_vfflush,
+	NULL,  // pread
+	NULL,  // pwrite
+};
+
+// If the inner file supports positional I/O, the functions below are used
+// instead. Each slice then just keeps its own position, and there is no
+// need to seek the inner file every time we switch between slices.
+
+static size_t restricted_pread(void *ptr, size_t len, long offset,
+                               void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+
+	len = RestrictedItems(restricted, offset, 1, len);
+	if (len == 0) {
+		return 0;
+	}
+
+	return vfpread(ptr, len, restricted->start + offset, restricted->inner);
+}
+
+static size_t restricted_pwrite(const void *ptr, size_t len, long offset,
+                                void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+
+	if (restricted->ro) {
+		return 0;
+	}
+
+	len = RestrictedItems(restricted, offset, 1, len);
+	if (len == 0) {
+		return 0;
+	}
+
+	return vfpwrite(ptr, len, restricted->start + offset,
+	                restricted->inner);
+}
+
+static size_t restricted_pos_vfread(void *ptr, size_t size, size_t nitems,
+                                    void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	size_t nbytes;
+
+	nitems = RestrictedItems(restricted, restricted->pos, size, nitems);
+	if (nitems == 0) {
+		return 0;
+	}
+
+	nbytes = restricted_pread(ptr, size * nitems, restricted->pos, handle);
+	restricted->pos += nbytes;
+	return nbytes / size;
+}
+
+static size_t restricted_pos_vfwrite(const void *ptr, size_t size,
+                                     size_t nitems, void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	size_t nbytes;
+
+	if (restricted->ro) {
+		return -1;
+	}
+
+	nitems = RestrictedItems(restricted, restricted->pos, size, nitems);
+	if (nitems == 0) {
+		return 0;
+	}
+
+	nbytes = restricted_pwrite(ptr, size * nitems, restricted->pos, handle);
+	restricted->pos += nbytes;
+	return nbytes / size;
+}
+
+static int restricted_pos_vfseek(void *handle, long offset, int whence)
+{
+	struct restricted_vfile *restricted = handle;
+
+	assert(whence == SEEK_SET); // SEEK_{CUR,END} not implemented.
+
+	if (offset < 0 || (restricted->end >= 0
+	                && offset + restricted->start > restricted->end)) {
+		return -1;
+	}
+
+	restricted->pos = offset;
+	return 0;
+}
+
+static void restricted_pos_vfsync(void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	vfsync(restricted->inner);
+}
+
+static void restricted_pos_vfflush(void *handle)
+{
+	struct restricted_vfile *restricted = handle;
+	vfflush(restricted->inner);
+}
+
+static void restricted_pos_vfclose(void *handle)
+{
+	free(handle);
+}
+
+static struct vfile_functions restricted_pos_io_functions = {
+	restricted_pos_vfread,
+	restricted_pos_vfwrite,
+	restricted_pos_vfseek,
+	restricted_vftell,
+	restricted_vftruncate,
+	restricted_pos_vfclose,
+	restricted_pos_vfsync,
+	restricted_pos_vfflush,
+	restricted_pread,
+	restricted_pwrite,
 };
 
 // Create restricted file slice starting at given offset. end=-1 mean no limit
@@ -310,7 +876,11 @@ VFILE *vfrestrict(VFILE *inner, long start, long end, int ro)
 	restricted->end = end;
 	restricted->ro = ro;
 	restricted->pos = 0;
-	result = vfopen(restricted, &restricted_io_functions);
+	if (vfcanpread(inner)) {
+		result = vfopen(restricted, &restricted_pos_io_functions);
+	} else {
+		result = vfopen(restricted, &restricted_io_functions);
+	}
 
 	// Seek to start of new file.
 	if (result != NULL && vfseek(result, 0, SEEK_SET) != 0) {
@@ -320,9 +890,16 @@ VFILE *vfrestrict(VFILE *inner, long start, long end, int ro)
 	return result;
 }
 
+// Smallest allocation made when a memory file first grows.
+#define MEMORY_MIN_SIZE  256
+
 struct memory_vfile {
 	uint8_t *buf;
-	size_t buf_len, pos;
+	// buf_size is the allocated size of buf, which grows geometrically so
+	// that lots of small writes don't realloc() every time.
+	size_t buf_len, buf_size, pos;
+	// If true, buf belongs to somebody else and is read-only.
+	bool borrowed;
 };
 
 static size_t memory_vfread(void *ptr, size_t size, size_t nitems, void *handle)
@@ -347,11 +924,17 @@ static size_t memory_vfwrite(const void *ptr, size_t size,
 	size_t num_bytes = size * nitems;
 	size_t new_pos = f->pos + num_bytes;
 
-	if (new_pos > f->buf_len) {
-		f->buf = checked_realloc(f->buf, new_pos);
-		f->buf_len = new_pos;
+	if (f->borrowed) {
+		return 0;
 	}
 
+	if (new_pos > f->buf_size) {
+		f->buf_size = max(f->buf_size * 2, MEMORY_MIN_SIZE);
+		f->buf_size = max(f->buf_size, new_pos);
+		f->buf = checked_realloc(f->buf, f->buf_size);
+	}
+	f->buf_len = max(f->buf_len, new_pos);
+
 	memcpy(&f->buf[f->pos], ptr, num_bytes);
 	f->pos = new_pos;
 
@@ -392,7 +975,9 @@ static void memory_vftruncate(void *handle)
 {
 	struct memory_vfile *f = handle;
 
-	f->buf_len = f->pos;
+	if (!f->borrowed) {
+		f->buf_len = f->pos;
+	}
 }
 
 static void memory_vfsync(void *handle)
@@ -402,7 +987,9 @@ static void memory_vfsync(void *handle)
 static void memory_vfclose(void *handle)
 {
 	struct memory_vfile *f = handle;
-	free(f->buf);
+	if (!f->borrowed) {
+		free(f->buf);
+	}
 	free(f);
 }
 
@@ -414,6 +1001,9 @@ static struct vfile_functions memory_io_functions = {
 	memory_vftruncate,
 	memory_vfclose,
 	memory_vfsync,
+	NULL,  // flush
+	NULL,  // pread
+	NULL,  // pwrite
 };
 
 VFILE *vfopenmem(const void *buf, size_t buf_len)
@@ -424,6 +1014,19 @@ VFILE *vfopenmem(const void *buf, size_t buf_len)
 	memcpy(memfile->buf, buf, buf_len);
 	memfile->pos = 0;
 	memfile->buf_len = buf_len;
+	memfile->buf_size = buf_len;
+	return vfopen(memfile, &memory_io_functions);
+}
+
+VFILE *vfopenmemview(const void *buf, size_t buf_len)
+{
+	struct memory_vfile *memfile;
+	memfile = checked_calloc(1, sizeof(struct memory_vfile));
+	memfile->buf = (uint8_t *) buf;
+	memfile->pos = 0;
+	memfile->buf_len = buf_len;
+	memfile->buf_size = buf_len;
+	memfile->borrowed = true;
 	return vfopen(memfile, &memory_io_functions);
 }
 
@@ -441,37 +1044,251 @@ bool vfgetbuf(VFILE *f, void **buf, size_t *buf_len)
 	return true;
 }
 
+#define COPY_BUF_LEN   (64 * 1024)
+
+#ifdef __linux__
+
+// Largest amount to hand to the kernel in one call.
+#define KERNEL_COPY_LEN  (64L * 1024 * 1024)
+
+// Finds the file descriptor behind the given file or restricted slice of
+// one, and the absolute offsets within it of the file's start and end
+// (-1 if unlimited). Returns false if there is no such descriptor. If the
+// file is instrumented, *stats is set to point to its counts.
+static bool ResolveDescriptor(VFILE *f, bool write, int *fd,
+                              long *start, long *end,
+                              struct vfile_stats **stats)
+{
+	struct restricted_vfile *restricted;
+	struct instrumented_vfile *instr;
+
+	if (f->functions == &instrumented_io_functions) {
+		instr = f->handle;
+		*stats = &instr->stats;
+		return ResolveDescriptor(instr->inner, write, fd,
+		                         start, end, stats);
+	}
+
+	if (f->functions == &wrapped_io_functions) {
+		// Anything written through stdio must reach the descriptor
+		// before we go around it.
+		fflush(f->handle);
+		*fd = fileno((FILE *) f->handle);
+		*start = 0;
+		*end = -1;
+		return true;
+	}
+
+	if (f->functions != &restricted_pos_io_functions) {
+		return false;
+	}
+
+	restricted = f->handle;
+	if ((write && restricted->ro)
+	 || !ResolveDescriptor(restricted->inner, write, fd, start, end,
+	                       stats)) {
+		return false;
+	}
+	if (restricted->end >= 0
+	 && (*end < 0 || *start + restricted->end < *end)) {
+		*end = *start + restricted->end;
+	}
+	*start += restricted->start;
+	return true;
+}
+
+static void CountKernelCopy(struct vfile_stats *from_stats,
+                            struct vfile_stats *to_stats, size_t nbytes)
+{
+	struct vfile_stats *all_stats[] = {
+		from_stats,
+		to_stats != from_stats ? to_stats : NULL,
+		&current_operation->stats,
+	};
+	int i;
+
+	for (i = 0; i < arrlen(all_stats); i++) {
+		if (all_stats[i] != NULL) {
+			++all_stats[i]->copies;
+			all_stats[i]->copy_bytes += nbytes;
+		}
+	}
+}
+
+// Copies as much as possible of `from` to `to` inside the kernel, returning
+// the number of bytes copied. If this stops short (eg. the files are not
+// both backed by descriptors), vfcopy carries on from where it left off.
+static long KernelCopy(VFILE *from, VFILE *to)
+{
+	int from_fd, to_fd;
+	long from_start, from_end, to_start, to_end, from_pos, to_pos, len;
+	long total = 0;
+	bool use_sendfile = false;
+	struct vfile_stats *from_stats = NULL, *to_stats = NULL;
+	off_t in_off, out_off;
+	ssize_t result;
+
+	if (!ResolveDescriptor(from, false, &from_fd, &from_start, &from_end,
+	                       &from_stats)
+	 || !ResolveDescriptor(to, true, &to_fd, &to_start, &to_end,
+	                       &to_stats)) {
+		return 0;
+	}
+
+	from_pos = vftell(from);
+	to_pos = vftell(to);
+	in_off = from_start + from_pos;
+	out_off = to_start + to_pos;
+
+	for (;;) {
+		len = KERNEL_COPY_LEN;
+		if (from_end >= 0) {
+			len = min(len, from_end - in_off);
+		}
+		if (to_end >= 0) {
+			len = min(len, to_end - out_off);
+		}
+		if (len <= 0) {
+			break;
+		}
+
+		if (!use_sendfile) {
+			result = copy_file_range(from_fd, &in_off, to_fd,
+			                         &out_off, len, 0);
+			// Before Linux 5.3, copying between filesystems isn't
+			// supported, but sendfile() can do it. It writes at
+			// the descriptor's own offset, so it can only be used
+			// when the destination is a plain file.
+			use_sendfile = result < 0
+			            && to->functions == &wrapped_io_functions;
+		}
+		if (use_sendfile) {
+			if (lseek(to_fd, out_off, SEEK_SET) < 0) {
+				break;
+			}
+			result = sendfile(to_fd, from_fd, &in_off, len);
+			if (result > 0) {
+				out_off += result;
+			}
+		}
+		if (result <= 0) {
+			break;
+		}
+		total += result;
+
+		if (from_stats != NULL || to_stats != NULL) {
+			CountKernelCopy(from_stats, to_stats, result);
+		}
+	}
+
+	// Both files must end up where a normal copy would have left them.
+	if (total > 0) {
+		vfseek(from, from_pos + total, SEEK_SET);
+		vfseek(to, to_pos + total, SEEK_SET);
+	}
+
+	return total;
+}
+
+#endif
+
 int vfcopy(VFILE *from, VFILE *to)
 {
-	uint8_t buf[256];
+	struct memory_vfile *memfile;
+	uint8_t *buf;
 	size_t nbytes;
+	int result = 0;
+
+	// Data in memory (including mapped lumps) is written in one go.
+	if (from->functions == &memory_io_functions) {
+		SwitchSavedPos(from, true);
+		memfile = from->handle;
+		buf = &memfile->buf[memfile->pos];
+		nbytes = memfile->buf_len - memfile->pos;
+		if (vfwrite(buf, 1, nbytes, to) != nbytes) {
+			return -1;
+		}
+		memfile->pos += nbytes;
+		return 0;
+	}
 
+#ifdef __linux__
+	KernelCopy(from, to);
+#endif
+
+	buf = checked_malloc(COPY_BUF_LEN);
 	for (;;) {
-		nbytes = vfread(buf, 1, sizeof(buf), from);
+		nbytes = vfread(buf, 1, COPY_BUF_LEN, from);
 		if (nbytes == 0) {
-			return 0;
+			break;
 		}
 		if (vfwrite(buf, 1, nbytes, to) != nbytes) {
-			return -1;
+			result = -1;
+			break;
 		}
 	}
+	free(buf);
+
+	return result;
 }
 
-void *vfreadall(VFILE *input, size_t *len)
+// Takes the buffer away from a memory file, leaving it empty.
+static void *StealBuffer(struct memory_vfile *memfile, size_t *len)
 {
-	VFILE *tmp = vfopenmem(NULL, 0);
-	struct memory_vfile *memfile;
-	void *result;
+	void *result = memfile->buf;
 
-	vfcopy(input, tmp);
-	memfile	= tmp->handle;
-	result = memfile->buf;
+	// Don't hang on to the spare space from growing the buffer.
+	if (memfile->buf_size > memfile->buf_len && memfile->buf_len > 0) {
+		result = checked_realloc(result, memfile->buf_len);
+	}
 	if (len != NULL) {
 		*len = memfile->buf_len;
 	}
 	memfile->buf = NULL;
 	memfile->buf_len = 0;
+	memfile->buf_size = 0;
+	memfile->pos = 0;
+
+	return result;
+}
+
+void *vfreadall(VFILE *input, size_t *len)
+{
+	struct memory_vfile *memfile = input->handle;
+	VFILE *tmp;
+	void *result;
+
+	// If the input is a memory file that we would read in its entirety
+	// anyway, there's no need to copy it; just take its buffer.
+	if (input->functions == &memory_io_functions && !memfile->borrowed) {
+		SwitchSavedPos(input, true);
+		if (memfile->pos == 0) {
+			return StealBuffer(memfile, len);
+		}
+	}
+
+	tmp = vfopenmem(NULL, 0);
+	vfcopy(input, tmp);
+	result = StealBuffer(tmp->handle, len);
 	vfclose(tmp);
 
 	return result;
 }
+
+const void *vfmapall(VFILE *input, size_t *len, void **to_free)
+{
+	struct memory_vfile *memfile = input->handle;
+	const void *result;
+
+	if (input->functions != &memory_io_functions) {
+		*to_free = vfreadall(input, len);
+		return *to_free;
+	}
+
+	result = memfile->buf + memfile->pos;
+	*len = memfile->buf_len - memfile->pos;
+	*to_free = NULL;
+	memfile->pos = memfile->buf_len;
+
+	return result;
+}
@@ -31,6 +31,12 @@ struct vfile_functions {
 	void (*truncate)(void *handle);
 	void (*close)(void *handle);
 	void (*sync)(void *handle);
+	void (*flush)(void *handle);
+
+	// Optional: read/write at the given offset without using or changing
+	// the current position. Returns the number of bytes transferred.
+	size_t (*pread)(void *ptr, size_t len, long offset, void *handle);
+	size_t (*pwrite)(const void *ptr, size_t len, long offset, void *handle);
 };
 
 VFILE *vfopen(void *handle, struct vfile_functions *funcs);
@@ -44,21 +50,77 @@ void vfonclose(VFILE *stream, void (*callback)(VFILE *, void *), void *data);
 size_t vfread(void *ptr, size_t size, size_t nitems, VFILE *stream);
 size_t vfwrite(const void *ptr, size_t size, size_t nitems, VFILE *stream);
 
+// Positional read/write that leaves the current position untouched. Only
+// available if vfcanpread() returns true for the file.
+bool vfcanpread(VFILE *stream);
+size_t vfpread(void *ptr, size_t len, long offset, VFILE *stream);
+size_t vfpwrite(const void *ptr, size_t len, long offset, VFILE *stream);
+
 // Truncates at current position (unlike ftruncate).
 void vftruncate(VFILE *stream);
 
 // Read/write to memory buffer.
 VFILE *vfopenmem(const void *buf, size_t buf_len);
 bool vfgetbuf(VFILE *f, void **buf, size_t *buf_len);
+
+// Reads the rest of the file into a new buffer. If the file is a memory
+// file positioned at the start, its buffer is handed over without copying
+// and the file is left empty.
 void *vfreadall(VFILE *input, size_t *len);
 
+// Read-only view of a memory buffer. Unlike vfopenmem(), the buffer is not
+// copied, so it must remain valid until the VFILE is closed.
+VFILE *vfopenmemview(const void *buf, size_t buf_len);
+
+// Like vfreadall(), but if the file is backed by memory (including views
+// created with vfopenmemview) a pointer to the data is returned without
+// copying. The pointer is valid until the file is closed. If a copy had to
+// be made, *to_free is set to the buffer to free afterwards, else NULL.
+const void *vfmapall(VFILE *input, size_t *len, void **to_free);
+
 int vfseek(VFILE *stream, long offset, int whence);
 long vftell(VFILE *stream);
 
 void vfsync(VFILE *stream);
+// Write any buffered data to the underlying file, without waiting for it
+// to reach the disk (unlike vfsync).
+void vfflush(VFILE *stream);
 void vfclose(VFILE *stream);
 VFILE_CONTEXT *vfswitchcontext(VFILE *f, VFILE_CONTEXT *ctx);
 
+// Once I/O statistics are enabled, every file opened with vfwrapfile()
+// counts the calls made on it and the bytes transferred. Each file's
+// counts are written to the log when it is closed, and the totals for each
+// operation are written at exit.
+void vfenableiostats(FILE *log);
+
+// Names the file in the I/O statistics log; does nothing if I/O statistics
+// are not enabled.
+void vfsetname(VFILE *stream, const char *name);
+
+// Sets the operation that I/O is counted against until the next call, and
+// returns the previous one (NULL for none). The name must remain valid.
+const char *vfsetoperation(const char *name);
+
+// Slow storage simulation, for benchmarking (see bench/wadbench.c). Once
+// enabled, every file opened with vfwrapfile() is delayed as below.
+struct vfile_slowio {
+	// Delay for a read or write that doesn't start where the last one
+	// ended.
+	unsigned int seek_usec;
+	// Delay per kilobyte read or written.
+	unsigned int usec_per_kb;
+	// Delay for each sync or truncate.
+	unsigned int sync_usec;
+};
+
+void vfsimulateslowio(const struct vfile_slowio *config);
+
+// Returns true if slow storage is being simulated. Files must then only be
+// accessed through VFILEs, not mapped into memory, or the delays would be
+// bypassed.
+bool vfslowio(void);
+
 #define WITH_VFCONTEXT(vf, ctx, statement) do { \
 		VFILE_CONTEXT *saved_ctx = vfswitchcontext(vf, ctx); \
 		statement; \
@@ -24,28 +24,76 @@
 
 struct directory *VFS_OpenRealDir(const char *path);  // real_dir.c
 struct directory *VFS_OpenWadAsDirectory(const char *path);  // wad_dir.c
-
-// Yes, Si units, not binary ones.
-#define KB(x) (x * 1000ULL)
-#define MB(x) (KB(x) * 1000ULL)
-#define GB(x) (MB(x) * 1000ULL)
-#define TB(x) (GB(x) * 1000ULL)
+void VFS_ReadWatchEvents(void);  // real_dir.c
 
 struct directory_entry _vfs_parent_directory = {
 	FILE_TYPE_DIR, "..", 0, UINT64_MAX,
 };
 
+// Most revisions are stored as a delta against the previous revision, but
+// every so often we store a full copy (a keyframe), so that restoring a
+// revision never needs too many deltas to be applied.
+#define KEYFRAME_INTERVAL 16
+
+// Each delta is the length of the prefix and suffix that are unchanged
+// from the previous revision, followed by the data in between.
+#define DELTA_HEADER_LEN (2 * sizeof(uint32_t))
+#define DELTA_BLOCK_LEN  64
+
+// Smallest block that entry names are allocated from; each new block is
+// at least twice the size of the last, so that even a huge directory only
+// needs a handful.
+#define ENTRY_NAMES_MIN_SIZE 4096
+
+struct entry_names {
+	struct entry_names *next;
+	size_t size, used;
+	char data[];
+};
+
 static char last_error[128];
 static struct directory *open_dirs = NULL;
 
+// Once the undo history of all directories takes up more than this much
+// memory, old revisions are moved out to a temporary file.
+static size_t history_memory_cap = MB(16);
+static size_t history_memory_used;
+static VFILE *history_file;
+
+// Full snapshot of the most recently saved revision, which is usually the
+// one the next revision will be a delta against.
+static struct directory_revision *cached_revision;
+static void *cached_snapshot;
+static size_t cached_snapshot_len;
+
+static void SetCachedSnapshot(struct directory_revision *r, void *snapshot,
+                              size_t len)
+{
+	free(cached_snapshot);
+	cached_revision = r;
+	cached_snapshot = snapshot;
+	cached_snapshot_len = len;
+}
+
+static void FreeRevision(struct directory_revision *r)
+{
+	if (r == cached_revision) {
+		SetCachedSnapshot(NULL, NULL, 0);
+	}
+	if (r->snapshot != NULL) {
+		history_memory_used -= r->snapshot_len;
+		free(r->snapshot);
+	}
+	free(r);
+}
+
 static void FreeRevisionChainBackward(struct directory_revision *r)
 {
 	struct directory_revision *prev;
 
 	while (r != NULL) {
 		prev = r->prev;
-		free(r->snapshot);
-		free(r);
+		FreeRevision(r);
 		r = prev;
 	}
 }
@@ -56,27 +104,362 @@ static void FreeRevisionChainForward(struct directory_revision *r)
 
 	while (r != NULL) {
 		next = r->next;
-		free(r->snapshot);
-		free(r);
+		FreeRevision(r);
 		r = next;
 	}
 }
 
+// Returns the stored data for the given revision, which may need to be
+// read back from the history file; if so, *to_free must be freed.
+static const uint8_t *RevisionData(struct directory_revision *r,
+                                   void **to_free)
+{
+	*to_free = NULL;
+	if (r->snapshot != NULL) {
+		return r->snapshot;
+	}
+
+	*to_free = checked_malloc(r->snapshot_len + 1);
+	assert(vfseek(history_file, r->spill_offset, SEEK_SET) == 0);
+	assert(vfread(*to_free, 1, r->snapshot_len, history_file)
+	       == r->snapshot_len);
+
+	return *to_free;
+}
+
+// Returns the full snapshot for the given revision. Unless it is cached or
+// is a keyframe, it is reconstructed by starting from the last keyframe and
+// applying every delta since then; *to_free must be freed afterwards.
+static const uint8_t *RevisionSnapshot(struct directory_revision *r,
+                                       size_t *len, void **to_free)
+{
+	struct directory_revision *k = r;
+	uint8_t *result, *next;
+	const uint8_t *data;
+	uint32_t prefix, suffix;
+	size_t middle;
+	void *data_to_free;
+
+	if (r == cached_revision) {
+		*to_free = NULL;
+		*len = cached_snapshot_len;
+		return cached_snapshot;
+	}
+
+	while (!k->keyframe) {
+		assert(k->prev != NULL);
+		k = k->prev;
+	}
+
+	data = RevisionData(k, to_free);
+	*len = k->snapshot_len;
+	if (k == r) {
+		return data;
+	}
+
+	if (*to_free != NULL) {
+		result = *to_free;
+	} else {
+		result = checked_malloc(k->snapshot_len + 1);
+		memcpy(result, data, k->snapshot_len);
+	}
+
+	while (k != r) {
+		k = k->next;
+		data = RevisionData(k, &data_to_free);
+		memcpy(&prefix, data, sizeof(uint32_t));
+		memcpy(&suffix, data + sizeof(uint32_t), sizeof(uint32_t));
+		middle = k->snapshot_len - DELTA_HEADER_LEN;
+
+		next = checked_malloc(prefix + middle + suffix + 1);
+		memcpy(next, result, prefix);
+		memcpy(next + prefix, data + DELTA_HEADER_LEN, middle);
+		memcpy(next + prefix + middle, result + *len - suffix, suffix);
+		free(result);
+		free(data_to_free);
+		result = next;
+		*len = prefix + middle + suffix;
+	}
+
+	*to_free = result;
+	return result;
+}
+
+static uint8_t *EncodeDelta(const uint8_t *old, size_t old_len,
+                            const uint8_t *new, size_t new_len,
+                            size_t *delta_len)
+{
+	uint32_t prefix = 0, suffix = 0;
+	size_t middle;
+	uint8_t *result;
+
+	// Skip quickly over identical blocks before comparing byte by byte.
+	while (prefix + DELTA_BLOCK_LEN <= min(old_len, new_len)
+	    && !memcmp(old + prefix, new + prefix, DELTA_BLOCK_LEN)) {
+		prefix += DELTA_BLOCK_LEN;
+	}
+	while (prefix < old_len && prefix < new_len
+	    && old[prefix] == new[prefix]) {
+		++prefix;
+	}
+	while (suffix + DELTA_BLOCK_LEN <= min(old_len, new_len) - prefix
+	    && !memcmp(old + old_len - suffix - DELTA_BLOCK_LEN,
+	               new + new_len - suffix - DELTA_BLOCK_LEN,
+	               DELTA_BLOCK_LEN)) {
+		suffix += DELTA_BLOCK_LEN;
+	}
+	while (suffix < old_len - prefix && suffix < new_len - prefix
+	    && old[old_len - suffix - 1] == new[new_len - suffix - 1]) {
+		++suffix;
+	}
+
+	middle = new_len - prefix - suffix;
+	*delta_len = DELTA_HEADER_LEN + middle;
+	result = checked_malloc(*delta_len);
+	memcpy(result, &prefix, sizeof(uint32_t));
+	memcpy(result + sizeof(uint32_t), &suffix, sizeof(uint32_t));
+	memcpy(result + DELTA_HEADER_LEN, new + prefix, middle);
+
+	return result;
+}
+
+// Stores the given snapshot data for a new revision that follows prev,
+// taking ownership of it.
+static void StoreRevisionData(struct directory_revision *r,
+                              struct directory_revision *prev,
+                              uint8_t *data, size_t len)
+{
+	struct directory_revision *k;
+	const uint8_t *prev_data;
+	uint8_t *delta;
+	size_t prev_len, delta_len;
+	void *to_free;
+	int since_keyframe = 0;
+
+	for (k = prev; k != NULL && !k->keyframe; k = k->prev) {
+		++since_keyframe;
+	}
+
+	r->keyframe = true;
+	r->snapshot = data;
+	r->snapshot_len = len;
+
+	if (prev != NULL && since_keyframe < KEYFRAME_INTERVAL - 1) {
+		prev_data = RevisionSnapshot(prev, &prev_len, &to_free);
+		delta = EncodeDelta(prev_data, prev_len, data, len,
+		                    &delta_len);
+		free(to_free);
+		if (delta_len < len) {
+			r->keyframe = false;
+			r->snapshot = delta;
+			r->snapshot_len = delta_len;
+		} else {
+			free(delta);
+		}
+	}
+
+	if (r->keyframe) {
+		data = checked_malloc(len + 1);
+		memcpy(data, r->snapshot, len);
+	}
+	SetCachedSnapshot(r, data, len);
+	history_memory_used += r->snapshot_len;
+}
+
+// Moves the oldest revisions of the given directory out to the history
+// file until we are back under the memory cap.
+static void SpillOldRevisions(struct directory *dir)
+{
+	struct directory_revision *r = dir->curr_revision;
+
+	if (history_memory_used <= history_memory_cap) {
+		return;
+	}
+	if (history_file == NULL) {
+		history_file = vfwrapfile(tmpfile());
+		if (history_file == NULL) {
+			return;
+		}
+		vfsetname(history_file, "(undo history)");
+	}
+
+	while (r->prev != NULL) {
+		r = r->prev;
+	}
+
+	for (; r != dir->curr_revision
+	    && history_memory_used > history_memory_cap; r = r->next) {
+		if (r->snapshot == NULL) {
+			continue;
+		}
+		if (vfseek(history_file, 0, SEEK_END) != 0) {
+			return;
+		}
+		r->spill_offset = vftell(history_file);
+		if (vfwrite(r->snapshot, 1, r->snapshot_len, history_file)
+		    != r->snapshot_len) {
+			return;
+		}
+		history_memory_used -= r->snapshot_len;
+		free(r->snapshot);
+		r->snapshot = NULL;
+	}
+}
+
+void VFS_SetHistoryMemoryCap(size_t bytes)
+{
+	history_memory_cap = bytes;
+}
+
 char *VFS_EntryPath(struct directory *dir, struct directory_entry *entry)
 {
 	return StringJoin("/", dir->path, entry->name, NULL);
 }
 
-void VFS_FreeEntries(struct directory *d)
+static void AddNamesBlock(struct entry_names **names, size_t size)
 {
-	int i;
+	struct entry_names *block;
 
-	for (i = 0; i < d->num_entries; i++) {
-		free(d->entries[i].name);
+	if (*names != NULL) {
+		size = max(size, (*names)->size * 2);
+	}
+	block = checked_malloc(sizeof(struct entry_names) + size);
+	block->next = *names;
+	block->size = size;
+	block->used = 0;
+	*names = block;
+}
+
+void VFS_ReserveEntryNames(struct entry_names **names, size_t bytes)
+{
+	if (bytes > 0 && (*names == NULL
+	                || (*names)->size - (*names)->used < bytes)) {
+		AddNamesBlock(names, bytes);
+	}
+}
+
+char *VFS_AllocEntryName(struct entry_names **names, size_t len)
+{
+	char *result;
+
+	if (*names == NULL || (*names)->size - (*names)->used < len + 1) {
+		AddNamesBlock(names, max(len + 1, ENTRY_NAMES_MIN_SIZE));
 	}
+	result = (*names)->data + (*names)->used;
+	(*names)->used += len + 1;
+	result[len] = '\0';
+
+	return result;
+}
+
+static void FreeEntryNames(struct entry_names *names)
+{
+	struct entry_names *next;
+
+	while (names != NULL) {
+		next = names->next;
+		free(names);
+		names = next;
+	}
+}
+
+void VFS_FreeEntries(struct directory *d)
+{
 	free(d->entries);
+	FreeEntryNames(d->entry_names);
 	d->entries = NULL;
 	d->num_entries = 0;
+	d->entry_names = NULL;
+	d->stale_names = 0;
+	d->index_stale = true;
+}
+
+// Copies all entry names into a new set of blocks, to reclaim the space
+// used by names of entries that were replaced or removed.
+static void RepackEntryNames(struct directory *d)
+{
+	struct entry_names *names = NULL;
+	size_t i, len, total = 0;
+	char *name;
+
+	for (i = 0; i < d->num_entries; i++) {
+		total += strlen(d->entries[i].name) + 1;
+	}
+	VFS_ReserveEntryNames(&names, total);
+	for (i = 0; i < d->num_entries; i++) {
+		len = strlen(d->entries[i].name);
+		name = VFS_AllocEntryName(&names, len);
+		memcpy(name, d->entries[i].name, len);
+		d->entries[i].name = name;
+	}
+	FreeEntryNames(d->entry_names);
+	d->entry_names = names;
+	d->stale_names = 0;
+}
+
+static void FreeIndexes(struct directory *d)
+{
+	free(d->serial_buckets);
+	free(d->serial_chain);
+	free(d->name_buckets);
+	free(d->name_chain);
+	d->serial_buckets = NULL;
+	d->serial_chain = NULL;
+	d->name_buckets = NULL;
+	d->name_chain = NULL;
+	d->index_stale = true;
+}
+
+static unsigned int SerialHash(uint64_t serial_no)
+{
+	return (serial_no * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static unsigned int EntryNameHash(const char *name)
+{
+	unsigned int result = 5381;
+
+	for (; *name != '\0'; ++name) {
+		result = result * 33 + (unsigned char) *name;
+	}
+
+	return result;
+}
+
+static void RebuildIndexes(struct directory *d)
+{
+	unsigned int b;
+	int i;
+
+	FreeIndexes(d);
+
+	d->num_index_buckets = 64;
+	while (d->num_index_buckets < d->num_entries) {
+		d->num_index_buckets *= 2;
+	}
+	d->serial_buckets = checked_malloc(d->num_index_buckets * sizeof(int));
+	d->name_buckets = checked_malloc(d->num_index_buckets * sizeof(int));
+	d->serial_chain = checked_malloc((d->num_entries + 1) * sizeof(int));
+	d->name_chain = checked_malloc((d->num_entries + 1) * sizeof(int));
+
+	for (b = 0; b < d->num_index_buckets; b++) {
+		d->serial_buckets[b] = -1;
+		d->name_buckets[b] = -1;
+	}
+
+	// Add in reverse order so that the first matching entry is always
+	// at the head of its chain.
+	for (i = d->num_entries - 1; i >= 0; i--) {
+		b = SerialHash(d->entries[i].serial_no) % d->num_index_buckets;
+		d->serial_chain[i] = d->serial_buckets[b];
+		d->serial_buckets[b] = i;
+
+		b = EntryNameHash(d->entries[i].name) % d->num_index_buckets;
+		d->name_chain[i] = d->name_buckets[b];
+		d->name_buckets[b] = i;
+	}
+
+	d->index_stale = false;
 }
 
 static char *ParentName(const char *path)
@@ -99,6 +482,9 @@ void VFS_InitDirectory(struct directory *d, const char *path)
 	d->refcount = 1;
 	d->entries = NULL;
 	d->num_entries = 0;
+	d->entry_names = NULL;
+	d->stale_names = 0;
+	d->index_stale = true;
 }
 
 static struct directory *FindOpenDir(const char *path)
@@ -190,10 +576,16 @@ struct directory_entry *VFS_EntryBySerial(struct directory *dir,
 {
 	int i;
 
-	for (i = 0; i < dir->num_entries; i++) {
+	if (dir->index_stale) {
+		RebuildIndexes(dir);
+	}
+
+	i = dir->serial_buckets[SerialHash(serial_no) % dir->num_index_buckets];
+	while (i >= 0) {
 		if (dir->entries[i].serial_no == serial_no) {
 			return &dir->entries[i];
 		}
+		i = dir->serial_chain[i];
 	}
 
 	return NULL;
@@ -204,10 +596,16 @@ struct directory_entry *VFS_EntryByName(struct directory *dir,
 {
 	int i;
 
-	for (i = 0; i < dir->num_entries; i++) {
+	if (dir->index_stale) {
+		RebuildIndexes(dir);
+	}
+
+	i = dir->name_buckets[EntryNameHash(name) % dir->num_index_buckets];
+	while (i >= 0) {
 		if (!strcmp(dir->entries[i].name, name)) {
 			return &dir->entries[i];
 		}
+		i = dir->name_chain[i];
 	}
 
 	return NULL;
@@ -223,6 +621,8 @@ struct directory_entry *VFS_EntryByName(struct directory *dir,
 struct directory_revision *VFS_SaveRevision(struct directory *dir)
 {
 	struct directory_revision *result;
+	uint8_t *data;
+	size_t len;
 	VFILE *out;
 
 	if (dir->directory_funcs->save_snapshot == NULL) {
@@ -234,8 +634,11 @@ struct directory_revision *VFS_SaveRevision(struct directory *dir)
 		return NULL;
 	}
 
+	data = vfreadall(out, &len);
+	vfclose(out);
+
 	result = checked_calloc(1, sizeof(struct directory_revision));
-	result->snapshot = vfreadall(out, &result->snapshot_len);
+	StoreRevisionData(result, dir->curr_revision, data, len);
 
 	result->prev = dir->curr_revision;
 	if (dir->curr_revision != NULL) {
@@ -244,6 +647,7 @@ struct directory_revision *VFS_SaveRevision(struct directory *dir)
 		dir->curr_revision->next = result;
 	}
 	dir->curr_revision = result;
+	SpillOldRevisions(dir);
 	return result;
 }
 
@@ -269,15 +673,128 @@ void VFS_CommitChanges(struct directory *dir, const char *msg, ...)
 	}
 }
 
+// Applies the given changes to the entries array. Inserted and modified
+// entries are given a NULL name, and [*lo, *hi) is set to the range that
+// includes all of them.
+static void ApplyChanges(struct directory *dir,
+                         const struct directory_change *changes,
+                         size_t num_changes, unsigned int *lo,
+                         unsigned int *hi)
+{
+	const struct directory_change *c;
+	unsigned int i, tail;
+
+	*lo = dir->num_entries;
+	*hi = 0;
+
+	for (c = changes; c < changes + num_changes; c++) {
+		assert(c->index <= dir->num_entries);
+		tail = dir->num_entries - c->index;
+
+		switch (c->type) {
+		case VFS_CHANGE_INSERT:
+			dir->entries = checked_realloc(dir->entries,
+				(dir->num_entries + c->count)
+				  * sizeof(struct directory_entry));
+			memmove(&dir->entries[c->index + c->count],
+			        &dir->entries[c->index],
+			        tail * sizeof(struct directory_entry));
+			dir->num_entries += c->count;
+			if (*hi > c->index) {
+				*hi += c->count;
+			}
+			break;
+
+		case VFS_CHANGE_REMOVE:
+			assert(c->count <= tail);
+			memmove(&dir->entries[c->index],
+			        &dir->entries[c->index + c->count],
+			        (tail - c->count)
+			          * sizeof(struct directory_entry));
+			dir->num_entries -= c->count;
+			dir->stale_names += c->count;
+			if (*hi > c->index + c->count) {
+				*hi -= c->count;
+			} else if (*hi > c->index) {
+				*hi = c->index;
+			}
+			if (*lo > c->index + c->count) {
+				*lo -= c->count;
+			} else if (*lo > c->index) {
+				*lo = c->index;
+			}
+			continue;
+
+		case VFS_CHANGE_MODIFY:
+			assert(c->count <= tail);
+			dir->stale_names += c->count;
+			break;
+		}
+
+		for (i = c->index; i < c->index + c->count; i++) {
+			dir->entries[i].name = NULL;
+		}
+		*lo = min(*lo, c->index);
+		*hi = max(*hi, c->index + c->count);
+	}
+}
+
+// Updates the entries in place from the changes reported by the backend,
+// which saves rebuilding all of them after a small edit. Returns false if
+// the backend can't tell us what changed.
+static bool RefreshChanges(struct directory *dir, int *first_change)
+{
+	const struct directory_funcs *funcs = dir->directory_funcs;
+	const struct directory_change *changes;
+	size_t i, num_changes;
+	unsigned int lo, hi;
+
+	if (funcs->changes == NULL
+	 || !funcs->changes(dir, &changes, &num_changes)) {
+		return false;
+	}
+
+	*first_change = -1;
+	if (num_changes == 0) {
+		return true;
+	}
+
+	ApplyChanges(dir, changes, num_changes, &lo, &hi);
+	for (i = lo; i < hi; i++) {
+		if (dir->entries[i].name == NULL) {
+			funcs->refresh_entry(dir, i, &dir->entries[i],
+			                     &dir->entry_names);
+		}
+	}
+	dir->index_stale = true;
+	if (dir->stale_names > dir->num_entries) {
+		RepackEntryNames(dir);
+	}
+
+	for (i = 0; i < num_changes; i++) {
+		if (changes[i].index < dir->num_entries
+		 && (*first_change < 0 || changes[i].index < *first_change)) {
+			*first_change = changes[i].index;
+		}
+	}
+
+	return true;
+}
+
 // Reload the list of entries for the given directory, returning the index
 // of the first entry to change (or -1 for no change)
 int VFS_Refresh(struct directory *dir)
 {
 	struct directory_entry *entries = NULL;
+	struct entry_names *names = NULL;
 	size_t num_entries = 0;
 	int i, result;
 
-	dir->directory_funcs->refresh(dir, &entries, &num_entries);
+	if (RefreshChanges(dir, &result)) {
+		return result;
+	}
+
+	dir->directory_funcs->refresh(dir, &entries, &num_entries, &names);
 
 	// Find the first entry to have changed between the old and new.
 	result = -1;
@@ -293,6 +810,8 @@ int VFS_Refresh(struct directory *dir)
 	VFS_FreeEntries(dir);
 	dir->entries = entries;
 	dir->num_entries = num_entries;
+	dir->entry_names = names;
+	dir->index_stale = true;
 
 	return result;
 }
@@ -301,6 +820,8 @@ void VFS_RefreshAll(void)
 {
 	struct directory *d;
 
+	VFS_ReadWatchEvents();
+
 	for (d = open_dirs; d != NULL; d = d->next) {
 		VFS_Refresh(d);
 	}
@@ -320,10 +841,18 @@ bool VFS_Remove(struct directory *dir, struct directory_entry *entry)
 		return false;
 	}
 
+	// If the backend tracks its changes, the removal will be among
+	// them, so we must not apply it twice.
+	if (dir->directory_funcs->changes != NULL) {
+		VFS_Refresh(dir);
+		return true;
+	}
+
 	memmove(&dir->entries[index], &dir->entries[index + 1],
 	        (dir->num_entries - index - 1)
 	          * sizeof(struct directory_entry));
 	--dir->num_entries;
+	dir->index_stale = true;
 
 	return true;
 }
@@ -337,6 +866,8 @@ bool VFS_Rename(struct directory *dir, struct directory_entry *entry,
 	}
 
 	VFS_StoreError("");
+	// The entry's name may be changed in place.
+	dir->index_stale = true;
 	return dir->directory_funcs->rename(dir, entry, new_name);
 }
 
@@ -363,6 +894,7 @@ void VFS_DirectoryUnref(struct directory *dir)
 		FreeRevisionChainForward(dir->curr_revision);
 	}
 	VFS_FreeEntries(dir);
+	FreeIndexes(dir);
 	free(dir->parent_name);
 	free(dir->path);
 	free(dir);
@@ -392,9 +924,14 @@ bool VFS_SwapEntries(struct directory *dir, unsigned int x, unsigned int y)
 		return false;
 	}
 	dir->directory_funcs->swap_entries(dir, x, y);
+	if (dir->directory_funcs->changes != NULL) {
+		VFS_Refresh(dir);
+		return true;
+	}
 	tmp = dir->entries[x];
 	dir->entries[x] = dir->entries[y];
 	dir->entries[y] = tmp;
+	dir->index_stale = true;
 	return true;
 }
 
@@ -420,6 +957,9 @@ int VFS_CanUndo(struct directory *dir)
 void VFS_Undo(struct directory *dir, unsigned int levels)
 {
 	struct directory_revision *r = dir->curr_revision;
+	const uint8_t *snapshot;
+	size_t snapshot_len;
+	void *to_free;
 	VFILE *in;
 	int i;
 
@@ -432,8 +972,10 @@ void VFS_Undo(struct directory *dir, unsigned int levels)
 	}
 	dir->curr_revision = r;
 
-	in = vfopenmem(r->snapshot, r->snapshot_len);
+	snapshot = RevisionSnapshot(r, &snapshot_len, &to_free);
+	in = vfopenmemview(snapshot, snapshot_len);
 	dir->directory_funcs->restore_snapshot(dir, in);
+	free(to_free);
 }
 
 int VFS_CanRedo(struct directory *dir)
@@ -458,6 +1000,9 @@ int VFS_CanRedo(struct directory *dir)
 void VFS_Redo(struct directory *dir, unsigned int levels)
 {
 	struct directory_revision *r = dir->curr_revision;
+	const uint8_t *snapshot;
+	size_t snapshot_len;
+	void *to_free;
 	VFILE *in;
 	int i;
 
@@ -470,8 +1015,10 @@ void VFS_Redo(struct directory *dir, unsigned int levels)
 	}
 	dir->curr_revision = r;
 
-	in = vfopenmem(r->snapshot, r->snapshot_len);
+	snapshot = RevisionSnapshot(r, &snapshot_len, &to_free);
+	in = vfopenmemview(snapshot, snapshot_len);
 	dir->directory_funcs->restore_snapshot(dir, in);
+	free(to_free);
 }
 
 const char *VFS_LastCommitMessage(struct directory *dir)
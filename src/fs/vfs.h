@@ -49,10 +49,27 @@ struct directory_entry {
 	uint64_t serial_no;
 };
 
+enum directory_change_type {
+	VFS_CHANGE_INSERT,
+	VFS_CHANGE_REMOVE,
+	VFS_CHANGE_MODIFY,
+};
+
+// A range of entries that were inserted, removed or modified since the
+// directory was last refreshed.
+struct directory_change {
+	enum directory_change_type type;
+	unsigned int index, count;
+};
+
+// Entry names are allocated out of a chain of blocks that is freed all at
+// once along with the entries, instead of one string at a time.
+struct entry_names;
+
 struct directory_funcs {
 	const char *singular, *plural;
 	void (*refresh)(void *dir, struct directory_entry **entries,
-	                size_t *num_entries);
+	                size_t *num_entries, struct entry_names **names);
 	VFILE *(*open)(void *dir, struct directory_entry *entry);
 	struct directory *(*open_dir)(void *dir,
 	                              struct directory_entry *entry);
@@ -66,12 +83,27 @@ struct directory_funcs {
 	void (*restore_snapshot)(void *dir, VFILE *in);
 	// TODO: insert
 	void (*free)(void *dir);
+	// Optional; lets VFS_Refresh update the existing entries in place
+	// rather than rebuilding them all. changes returns the changes made
+	// since the last refresh, in the order they were made, or false if
+	// a full refresh is needed. refresh_entry then fills in a single
+	// entry that was inserted or modified.
+	bool (*changes)(void *dir, const struct directory_change **changes,
+	                size_t *num_changes);
+	void (*refresh_entry)(void *dir, unsigned int index,
+	                      struct directory_entry *entry,
+	                      struct entry_names **names);
 };
 
 struct directory_revision {
 	char descr[VFS_REVISION_DESCR_LEN];
+	// Unless this is a keyframe, the snapshot is stored as a delta
+	// against the previous revision. If it has been moved out to the
+	// history file, snapshot is NULL and spill_offset is its location.
 	void *snapshot;
 	size_t snapshot_len;
+	bool keyframe;
+	long spill_offset;
 	struct directory_revision *prev, *next;
 };
 
@@ -85,6 +117,18 @@ struct directory {
 	int refcount;
 	struct directory_entry *entries;
 	size_t num_entries;
+	struct entry_names *entry_names;
+	// Number of entries replaced or removed by incremental refreshes,
+	// whose old names are still taking up space in entry_names.
+	size_t stale_names;
+	// Hash indexes of entries by serial number and by name, for
+	// VFS_EntryBySerial and VFS_EntryByName. Each entry is chained from
+	// its buckets in ascending index order. They are rebuilt on next use
+	// whenever the entries change.
+	int *serial_buckets, *serial_chain;
+	int *name_buckets, *name_chain;
+	unsigned int num_index_buckets;
+	bool index_stale;
 	struct directory_revision *curr_revision;
 	struct directory *next;
 };
@@ -101,6 +145,10 @@ bool VFS_Rename(struct directory *dir, struct directory_entry *entry,
 void VFS_CommitChanges(struct directory *dir, const char *msg, ...);
 int VFS_Refresh(struct directory *dir);
 void VFS_RefreshAll(void);
+// Returns a descriptor that becomes readable when open directories may
+// have been changed by something else, or -1 if this is not supported.
+// VFS_RefreshAll picks up the changes.
+int VFS_WatchDescriptor(void);
 struct wad_file *VFS_WadFile(struct directory *dir);
 char *VFS_EntryPath(struct directory *dir, struct directory_entry *entry);
 struct directory_entry *VFS_EntryBySerial(struct directory *p,
@@ -121,10 +169,21 @@ void VFS_DirectoryUnref(struct directory *dir);
 void VFS_ClearSet(struct file_set *l);
 void VFS_AddToSet(struct file_set *l, uint64_t serial_no);
 void VFS_RemoveFromSet(struct file_set *l, uint64_t serial_no);
-struct directory_entry *VFS_AddGlobToSet(
-	struct directory *dir, struct file_set *l, const char *glob);
+// Marks all entries that match the given pattern: a glob (eg. "*.png"), or
+// a regular expression between slashes (eg. "/^E[1-4]M[1-9]$/"); either
+// can be negated with a leading '!'. *first_match is set to the first
+// entry matched, if any. Returns false if the pattern is invalid (see
+// VFS_LastError).
+bool VFS_AddPatternToSet(struct directory *dir, struct file_set *l,
+                         const char *pattern,
+                         struct directory_entry **first_match);
 bool VFS_SetHas(struct file_set *l, uint64_t serial_no);
 void VFS_CopySet(struct file_set *to, struct file_set *from);
+
+// Bulk operations; much faster than adding or removing one at a time.
+void VFS_AddManyToSet(struct file_set *l, const uint64_t *serials,
+                      size_t count);
+void VFS_RemoveSetFromSet(struct file_set *from, struct file_set *set);
 void VFS_FreeSet(struct file_set *set);
 
 int VFS_CanUndo(struct directory *dir);
@@ -134,11 +193,17 @@ void VFS_Redo(struct directory *dir, unsigned int levels);
 #define VFS_Rollback(d) VFS_Undo(d, 0)
 const char *VFS_LastCommitMessage(struct directory *dir);
 void VFS_ClearHistory(struct directory *dir);
+void VFS_SetHistoryMemoryCap(size_t bytes);
 
 // For use by implementations of struct directory.
 void VFS_InitDirectory(struct directory *d, const char *path);
 struct directory_revision *VFS_SaveRevision(struct directory *d);
 void VFS_FreeEntries(struct directory *d);
+// Returns space for a name of len characters, already NUL-terminated.
+char *VFS_AllocEntryName(struct entry_names **names, size_t len);
+// Makes sure that the next allocations, totalling up to the given number
+// of bytes (including terminators), all come from the same block.
+void VFS_ReserveEntryNames(struct entry_names **names, size_t bytes);
 
 void VFS_StoreError(const char *fmt, ...);
 const char *VFS_LastError(void);
@@ -22,30 +22,77 @@
 struct wad_directory {
 	struct directory dir;
 	struct wad_file *wad_file;
+	struct directory_change *changes;
+	size_t changes_size;
 };
 
+static void FillEntry(struct wad_file_entry *waddir, unsigned int index,
+                      struct directory_entry *ent,
+                      struct entry_names **names)
+{
+	ent->type = FILE_TYPE_LUMP;
+	ent->name = VFS_AllocEntryName(names, 8);
+	memcpy(ent->name, waddir[index].name, 8);
+	ent->size = waddir[index].size;
+	ent->serial_no = waddir[index].serial_no;
+}
+
 static void WadDirectoryRefresh(void *_dir, struct directory_entry **entries,
-                                size_t *num_entries)
+                                size_t *num_entries,
+                                struct entry_names **names)
 {
 	struct wad_directory *dir = _dir;
 	struct wad_file_entry *waddir = W_GetDirectory(dir->wad_file);
 	unsigned int i, num_lumps = W_NumLumps(dir->wad_file);
 
 	*entries = checked_calloc(num_lumps, sizeof(struct directory_entry));
+	VFS_ReserveEntryNames(names, num_lumps * 9);
 
 	for (i = 0; i < num_lumps; i++) {
-		struct directory_entry *ent = *entries + i;
-		ent->type = FILE_TYPE_LUMP;
-		ent->name = checked_calloc(9, 1);
-		memcpy(ent->name, waddir[i].name, 8);
-		ent->name[8] = '\0';
-		ent->size = waddir[i].size;
-		ent->serial_no = waddir[i].serial_no;
+		FillEntry(waddir, i, *entries + i, names);
 	}
 
 	*num_entries = num_lumps;
 }
 
+static bool WadDirChanges(void *_dir, const struct directory_change **changes,
+                          size_t *num_changes)
+{
+	struct wad_directory *dir = _dir;
+	const struct wad_change *wad_changes;
+	size_t i;
+
+	if (!W_TakeChanges(dir->wad_file, &wad_changes, num_changes)) {
+		return false;
+	}
+	if (*num_changes > dir->changes_size) {
+		dir->changes_size = *num_changes;
+		dir->changes = checked_realloc(dir->changes,
+			dir->changes_size * sizeof(struct directory_change));
+	}
+	for (i = 0; i < *num_changes; i++) {
+		dir->changes[i].type =
+			wad_changes[i].type == WAD_CHANGE_INSERT ?
+				VFS_CHANGE_INSERT :
+			wad_changes[i].type == WAD_CHANGE_REMOVE ?
+				VFS_CHANGE_REMOVE : VFS_CHANGE_MODIFY;
+		dir->changes[i].index = wad_changes[i].index;
+		dir->changes[i].count = wad_changes[i].count;
+	}
+	*changes = dir->changes;
+
+	return true;
+}
+
+static void WadDirRefreshEntry(void *_dir, unsigned int index,
+                               struct directory_entry *entry,
+                               struct entry_names **names)
+{
+	struct wad_directory *dir = _dir;
+
+	FillEntry(W_GetDirectory(dir->wad_file), index, entry, names);
+}
+
 static VFILE *WadDirOpen(void *_dir, struct directory_entry *entry)
 {
 	struct wad_directory *dir = _dir;
@@ -104,6 +151,7 @@ static void WadDirFree(void *_dir)
 	if (dir->wad_file != NULL) {
 		W_CloseFile(dir->wad_file);
 	}
+	free(dir->changes);
 }
 
 static void WadDirSwapEntries(void *_dir, unsigned int x, unsigned int y)
@@ -143,6 +191,8 @@ static const struct directory_funcs waddir_funcs = {
 	WadDirSaveSnapshot,
 	WadDirRestoreSnapshot,
 	WadDirFree,
+	WadDirChanges,
+	WadDirRefreshEntry,
 };
 
 struct directory *VFS_OpenWadAsDirectory(const char *path)
@@ -150,6 +200,7 @@ struct directory *VFS_OpenWadAsDirectory(const char *path)
 	struct directory_revision *rev;
 	struct wad_directory *d =
 		checked_calloc(1, sizeof(struct wad_directory));
+	const char *old_op = vfsetoperation("Open WAD");
 
 	d->dir.directory_funcs = &waddir_funcs;
 	VFS_InitDirectory(&d->dir, path);
@@ -157,14 +208,17 @@ struct directory *VFS_OpenWadAsDirectory(const char *path)
 	d->wad_file = W_OpenFile(path);
 	if (d->wad_file == NULL) {
 		VFS_CloseDir(&d->dir);
+		vfsetoperation(old_op);
 		return NULL;
 	}
 	// The directory is read-only if the file is read-only, but
 	// also if the file is an IWAD (we require confirmation first)
 	d->dir.readonly = W_IsReadOnly(d->wad_file) || W_IsIWAD(d->wad_file);
-	WadDirectoryRefresh(d, &d->dir.entries, &d->dir.num_entries);
+	WadDirectoryRefresh(d, &d->dir.entries, &d->dir.num_entries,
+	                    &d->dir.entry_names);
 	rev = VFS_SaveRevision(&d->dir);
 	snprintf(rev->descr, VFS_REVISION_DESCR_LEN, "Initial version");
+	vfsetoperation(old_op);
 
 	return &d->dir;
 }
@@ -18,6 +18,9 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "common.h"
 #include "ui/dialog.h"
@@ -25,22 +28,69 @@
 
 #define REVISION_DESCR_LEN  40
 #define WAD_FILE_ENTRY_LEN  16
+#define MAX_TRACKED_CHANGES 128
 
 struct snapshot {
 	struct wad_file_header header;
 	long eof;
 };
 
+// A range of bytes within the file.
+struct wad_extent {
+	uint32_t start, end;
+};
+
+enum lump_write_mode {
+	// Data is written straight to the end of the file. Only one lump
+	// can be written this way at a time.
+	WRITE_STREAM,
+	// Data is written into space that was set aside when the lump was
+	// opened for writing.
+	WRITE_RESERVED,
+	// Data is written to a memory buffer and only written to the file
+	// when the lump is closed.
+	WRITE_BUFFERED,
+};
+
+struct lump_writer {
+	struct wad_file *f;
+	unsigned int index;
+	enum lump_write_mode mode;
+	uint32_t pos;
+};
+
+// Lump headers that have been read, keyed by the lump's position and size.
+// Every directory that can be restored refers to data that is never
+// overwritten, so an entry stays valid for as long as any directory can
+// refer to that position and size.
+struct header_cache_entry {
+	uint64_t key;
+	uint8_t header[LUMP_HEADER_LEN];
+	bool used;
+};
+
+// Buffered lump that was closed while another lump was being streamed to
+// the end of the file. It gets written once the stream is closed.
+struct pending_lump {
+	unsigned int index;
+	uint8_t *data;
+	uint32_t size;
+	struct pending_lump *next;
+};
+
 struct wad_file {
 	VFILE *vfs;
+	int fd;
 	bool readonly;
 	struct wad_file_entry *directory;
 	int num_lumps;
 
-	// We can read as many lumps as we like, but only write one.
+	// We can read and write as many lumps as we like, but only one of
+	// the writers can be streaming to the end of the file.
 	int lump_open_count;
-	VFILE *current_write_lump;
-	unsigned int current_write_index;
+	unsigned int num_writers;
+	bool streaming;
+	struct pending_lump *pending;
 
 	struct wad_file_header header;
 
@@ -49,15 +99,133 @@ struct wad_file {
 	// overwriting previously written data.
 	long write_pos;
 
+	// Every directory that has been committed can be restored again
+	// through an undo snapshot, so the data it refers to must never be
+	// overwritten. This is the merged set of all those extents, which
+	// is only reset when the WAD is compacted.
+	struct wad_extent *pinned;
+	unsigned int num_pinned;
+
+	// Holes before write_pos that are not referenced by the current
+	// directory or any pinned extent, and so can be reused for new lump
+	// data. Rebuilt on demand whenever free_extents_stale is set.
+	struct wad_extent *free_extents;
+	unsigned int num_free_extents;
+	bool free_extents_stale;
+
 	// Call to W_CommitChanges needed.
 	bool dirty;
+
+	// The header on disk only ever points to a directory once all the
+	// data it refers to has been synced, so when we don't sync on
+	// every commit, the header is not written until the next sync.
+	enum wad_sync_mode sync_mode;
+	unsigned int sync_commits, sync_secs;
+	unsigned int unsynced_commits;
+	time_t last_sync;
+	bool header_stale;
+
+	// Read-only mapping of the file, which lets us read lumps without
+	// copying them through vfs. NULL if the file could not be mapped.
+	// Lump data may have been written since the mapping was created, so
+	// map_len may be shorter than the file.
+	uint8_t *map;
+	size_t map_len;
+
+	// Lump data has been written through vfs that may still be sitting
+	// in a stdio buffer, and so is not visible through the mapping yet.
+	bool need_flush;
+
+	// Hash index of lump names, for W_GetNumForName. Every lump is
+	// chained from the bucket for its name, in descending index order,
+	// so that the last lump with a given name is always found first.
+	// Adding or deleting lumps shifts the indexes of everything after
+	// them, so in that case we just rebuild the index on next use.
+	int *name_buckets, *name_chain;
+	unsigned int num_name_buckets;
+	bool name_index_stale;
+
+	// Open addressed hash table, with linear probing.
+	struct header_cache_entry *header_cache;
+	unsigned int header_cache_size, header_cache_count;
+
+	// Changes to the directory since W_TakeChanges was last called.
+	// If there are too many to track, we just flag that everything
+	// may have changed.
+	struct wad_change changes[MAX_TRACKED_CHANGES];
+	unsigned int num_changes;
+	bool changes_overflow;
+
+	// For each lump, a bit is set for every section whose start marker
+	// is at or before it without a matching end marker. Along with the
+	// index of the last end marker of each section, this tells us which
+	// section each lump is in. Adding, deleting, renaming or moving
+	// ordinary lumps only needs the map to be shifted, but if a marker
+	// is involved we rebuild it on next use.
+	uint8_t *section_map;
+	int last_section_end[NUM_WAD_SECTIONS];
+	bool section_map_stale;
+};
+
+struct section_markers {
+	const char *start1, *start2;
+	const char *end1, *end2;
+};
+
+static const struct section_markers section_markers[NUM_WAD_SECTIONS] = {
+	{"S_START", "SS_START", "S_END", "SS_END"},
+	{"P_START", "PP_START", "P_END", "PP_END"},
+	{"F_START", "FF_START", "F_END", "FF_END"},
+	{"C_START", "C_START", "C_END", "C_END"},
 };
 
-static void ReadLumpHeader(struct wad_file *wad, struct wad_file_entry *ent)
+static enum wad_sync_mode default_sync_mode = WAD_SYNC_EVERY_COMMIT;
+static unsigned int default_sync_commits, default_sync_secs;
+
+static void RecordChange(struct wad_file *f, enum wad_change_type type,
+                         unsigned int index, unsigned int count)
 {
-	size_t bytes = min(ent->size, LUMP_HEADER_LEN);
-	assert(vfseek(wad->vfs, ent->position, SEEK_SET) == 0);
-	assert(vfread(&ent->lump_header, 1, bytes, wad->vfs) == bytes);
+	struct wad_change *last;
+
+	if (count == 0 || f->changes_overflow) {
+		return;
+	}
+	last = f->num_changes > 0 ? &f->changes[f->num_changes - 1] : NULL;
+	// Lumps are usually written or renamed straight after they are
+	// added, and those changes are covered by the insert.
+	if (type == WAD_CHANGE_MODIFY && last != NULL
+	 && last->type != WAD_CHANGE_REMOVE
+	 && index >= last->index
+	 && index + count <= last->index + last->count) {
+		return;
+	}
+	if (type == WAD_CHANGE_MODIFY && last != NULL
+	 && last->type == WAD_CHANGE_MODIFY
+	 && index == last->index + last->count) {
+		last->count += count;
+		return;
+	}
+	if (f->num_changes >= MAX_TRACKED_CHANGES) {
+		f->changes_overflow = true;
+		return;
+	}
+	f->changes[f->num_changes].type = type;
+	f->changes[f->num_changes].index = index;
+	f->changes[f->num_changes].count = count;
+	++f->num_changes;
+}
+
+bool W_TakeChanges(struct wad_file *f, const struct wad_change **changes,
+                   size_t *num_changes)
+{
+	bool result = !f->changes_overflow;
+
+	*changes = f->changes;
+	*num_changes = result ? f->num_changes : 0;
+	f->num_changes = 0;
+	f->changes_overflow = false;
+
+	return result;
 }
 
 static uint64_t NewSerialNo(void)
@@ -68,6 +236,304 @@ static uint64_t NewSerialNo(void)
 	return result;
 }
 
+static uint64_t NewDataGen(void)
+{
+	static uint64_t data_gen = 1;
+	return data_gen++;
+}
+
+static unsigned int NameHash(const char *name)
+{
+	unsigned int result = 5381;
+	int i;
+
+	for (i = 0; i < 8 && name[i] != '\0'; i++) {
+		result = result * 33 + toupper(name[i]);
+	}
+
+	return result;
+}
+
+static void RebuildNameIndex(struct wad_file *f)
+{
+	unsigned int b;
+	int i;
+
+	free(f->name_buckets);
+	free(f->name_chain);
+
+	f->num_name_buckets = 64;
+	while (f->num_name_buckets < f->num_lumps) {
+		f->num_name_buckets *= 2;
+	}
+	f->name_buckets = checked_malloc(f->num_name_buckets * sizeof(int));
+	f->name_chain = checked_malloc((f->num_lumps + 1) * sizeof(int));
+
+	for (b = 0; b < f->num_name_buckets; b++) {
+		f->name_buckets[b] = -1;
+	}
+	for (i = 0; i < f->num_lumps; i++) {
+		b = NameHash(f->directory[i].name) % f->num_name_buckets;
+		f->name_chain[i] = f->name_buckets[b];
+		f->name_buckets[b] = i;
+	}
+
+	f->name_index_stale = false;
+}
+
+static void UnindexName(struct wad_file *f, int index)
+{
+	unsigned int b = NameHash(f->directory[index].name)
+	               % f->num_name_buckets;
+	int *link = &f->name_buckets[b];
+
+	while (*link != index) {
+		assert(*link >= 0);
+		link = &f->name_chain[*link];
+	}
+	*link = f->name_chain[index];
+}
+
+static void IndexName(struct wad_file *f, int index)
+{
+	unsigned int b = NameHash(f->directory[index].name)
+	               % f->num_name_buckets;
+	int *link = &f->name_buckets[b];
+
+	while (*link > index) {
+		link = &f->name_chain[*link];
+	}
+	f->name_chain[index] = *link;
+	*link = index;
+}
+
+// Returns a bitmask of the sections that the given lump name is a start
+// marker for, or end marker for if end=true.
+static unsigned int SectionMarkers(const char *name, bool end)
+{
+	const struct section_markers *m;
+	unsigned int s, result = 0;
+
+	for (s = 0; s < NUM_WAD_SECTIONS; s++) {
+		m = &section_markers[s];
+		if (!strncasecmp(name, end ? m->end1 : m->start1, 8)
+		 || !strncasecmp(name, end ? m->end2 : m->start2, 8)) {
+			result |= 1 << s;
+		}
+	}
+
+	return result;
+}
+
+static bool IsSectionMarker(const char *name)
+{
+	return SectionMarkers(name, false) != 0
+	    || SectionMarkers(name, true) != 0;
+}
+
+static void RebuildSectionMap(struct wad_file *f)
+{
+	unsigned int depth[NUM_WAD_SECTIONS];
+	unsigned int s, starts, ends, open = 0;
+	int i;
+
+	f->section_map = checked_realloc(f->section_map, f->num_lumps + 1);
+	for (s = 0; s < NUM_WAD_SECTIONS; s++) {
+		depth[s] = 0;
+		f->last_section_end[s] = -1;
+	}
+
+	// Sections can be nested, eg. FF_START/FF_END within F_START/F_END,
+	// so we count how deep we are inside each one.
+	for (i = 0; i < f->num_lumps; i++) {
+		starts = SectionMarkers(f->directory[i].name, false);
+		ends = SectionMarkers(f->directory[i].name, true);
+		for (s = 0; s < NUM_WAD_SECTIONS; s++) {
+			if ((starts & (1 << s)) != 0) {
+				++depth[s];
+				open |= 1 << s;
+			} else if ((ends & (1 << s)) != 0) {
+				f->last_section_end[s] = i;
+				if (depth[s] > 0 && --depth[s] == 0) {
+					open &= ~(1 << s);
+				}
+			}
+		}
+		f->section_map[i] = open;
+	}
+
+	f->section_map_stale = false;
+}
+
+// Makes room in the section map for ordinary lumps that have been inserted.
+static void SectionMapInsert(struct wad_file *f, unsigned int index,
+                             unsigned int count)
+{
+	unsigned int s;
+
+	if (f->section_map_stale) {
+		return;
+	}
+	f->section_map = checked_realloc(f->section_map, f->num_lumps + 1);
+	memmove(&f->section_map[index + count], &f->section_map[index],
+	        f->num_lumps - index - count);
+	memset(&f->section_map[index], index > 0 ?
+	       f->section_map[index - 1] : 0, count);
+	for (s = 0; s < NUM_WAD_SECTIONS; s++) {
+		if (f->last_section_end[s] >= (int) index) {
+			f->last_section_end[s] += count;
+		}
+	}
+}
+
+// Must be called before the lumps are removed from the directory.
+static void SectionMapDelete(struct wad_file *f, unsigned int index,
+                             unsigned int count)
+{
+	unsigned int i, s;
+
+	if (f->section_map_stale) {
+		return;
+	}
+	for (i = index; i < index + count; i++) {
+		if (IsSectionMarker(f->directory[i].name)) {
+			f->section_map_stale = true;
+			return;
+		}
+	}
+	memmove(&f->section_map[index], &f->section_map[index + count],
+	        f->num_lumps - index - count);
+	for (s = 0; s < NUM_WAD_SECTIONS; s++) {
+		if (f->last_section_end[s] >= (int) index) {
+			f->last_section_end[s] -= count;
+		}
+	}
+}
+
+bool W_LumpInSection(struct wad_file *f, unsigned int index,
+                     enum wad_section section)
+{
+	assert(index < f->num_lumps);
+	if (f->section_map_stale) {
+		RebuildSectionMap(f);
+	}
+	return (f->section_map[index] & (1 << section)) != 0
+	    && f->last_section_end[section] > (int) index;
+}
+
+static uint64_t HeaderCacheKey(const struct wad_file_entry *ent)
+{
+	return ((uint64_t) ent->position << 32) | ent->size;
+}
+
+static unsigned int HeaderCacheSlot(struct wad_file *f, uint64_t key)
+{
+	key *= 0x9e3779b97f4a7c15ULL;
+	return (key >> 32) & (f->header_cache_size - 1);
+}
+
+static struct header_cache_entry *FindCachedHeader(struct wad_file *f,
+                                                   uint64_t key)
+{
+	unsigned int i;
+
+	if (f->header_cache_size == 0) {
+		return NULL;
+	}
+
+	i = HeaderCacheSlot(f, key);
+	while (f->header_cache[i].used) {
+		if (f->header_cache[i].key == key) {
+			return &f->header_cache[i];
+		}
+		i = (i + 1) & (f->header_cache_size - 1);
+	}
+
+	return NULL;
+}
+
+static void CacheHeader(struct wad_file *f, const struct wad_file_entry *ent);
+
+static void ResizeHeaderCache(struct wad_file *f, unsigned int new_size)
+{
+	struct header_cache_entry *old = f->header_cache;
+	unsigned int i, old_size = f->header_cache_size;
+	struct wad_file_entry ent;
+
+	f->header_cache = checked_calloc(new_size,
+	                                 sizeof(struct header_cache_entry));
+	f->header_cache_size = new_size;
+	f->header_cache_count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].used) {
+			ent.position = old[i].key >> 32;
+			ent.size = old[i].key & 0xffffffff;
+			memcpy(ent.lump_header, old[i].header, LUMP_HEADER_LEN);
+			CacheHeader(f, &ent);
+		}
+	}
+
+	free(old);
+}
+
+static void CacheHeader(struct wad_file *f, const struct wad_file_entry *ent)
+{
+	uint64_t key = HeaderCacheKey(ent);
+	struct header_cache_entry *ce = FindCachedHeader(f, key);
+	unsigned int i;
+
+	if (ce == NULL) {
+		if ((f->header_cache_count + 1) * 2 > f->header_cache_size) {
+			ResizeHeaderCache(f, max(f->header_cache_size * 2,
+			                         256));
+		}
+		i = HeaderCacheSlot(f, key);
+		while (f->header_cache[i].used) {
+			i = (i + 1) & (f->header_cache_size - 1);
+		}
+		ce = &f->header_cache[i];
+		ce->used = true;
+		ce->key = key;
+		++f->header_cache_count;
+	}
+	memcpy(ce->header, ent->lump_header, LUMP_HEADER_LEN);
+}
+
+// Called when new data is written, since an old entry for the same
+// position and size would no longer be valid.
+static void UncacheHeader(struct wad_file *f, const struct wad_file_entry *ent)
+{
+	struct header_cache_entry *ce = FindCachedHeader(f, HeaderCacheKey(ent));
+	unsigned int i, j, mask = f->header_cache_size - 1;
+
+	if (ce == NULL) {
+		return;
+	}
+
+	// Shift back any later entries in the same run, so that lookups
+	// never stop early at the slot we just emptied.
+	i = ce - f->header_cache;
+	f->header_cache[i].used = false;
+	--f->header_cache_count;
+	for (j = (i + 1) & mask; f->header_cache[j].used; j = (j + 1) & mask) {
+		unsigned int slot = HeaderCacheSlot(f, f->header_cache[j].key);
+		if (((j - slot) & mask) >= ((j - i) & mask)) {
+			f->header_cache[i] = f->header_cache[j];
+			f->header_cache[j].used = false;
+			i = j;
+		}
+	}
+}
+
+static void ClearHeaderCache(struct wad_file *f)
+{
+	free(f->header_cache);
+	f->header_cache = NULL;
+	f->header_cache_size = 0;
+	f->header_cache_count = 0;
+}
+
 static void SwapHeader(struct wad_file_header *hdr)
 {
 	SwapLE32(&hdr->num_lumps);
@@ -80,6 +546,163 @@ static void SwapEntry(struct wad_file_entry *entry)
 	SwapLE32(&entry->size);
 }
 
+static int CompareExtents(const void *x, const void *y)
+{
+	const struct wad_extent *ex = x, *ey = y;
+
+	if (ex->start != ey->start) {
+		return ex->start < ey->start ? -1 : 1;
+	}
+	return 0;
+}
+
+// Sorts the given extents and merges together any that overlap or touch.
+// Returns the new number of extents.
+static unsigned int MergeExtents(struct wad_extent *extents, unsigned int cnt)
+{
+	unsigned int i, result = 0;
+
+	qsort(extents, cnt, sizeof(struct wad_extent), CompareExtents);
+
+	for (i = 0; i < cnt; i++) {
+		if (extents[i].start == extents[i].end) {
+			continue;
+		}
+		if (result > 0 && extents[i].start <= extents[result - 1].end) {
+			extents[result - 1].end = max(extents[result - 1].end,
+			                              extents[i].end);
+		} else {
+			extents[result] = extents[i];
+			++result;
+		}
+	}
+
+	return result;
+}
+
+// Adds the extents for all lumps in the current directory, and the
+// directory itself, to the given array. Returns the new array length.
+static unsigned int AddDirectoryExtents(struct wad_file *f,
+                                        struct wad_extent *extents,
+                                        unsigned int cnt)
+{
+	int i;
+
+	for (i = 0; i < f->num_lumps; i++) {
+		extents[cnt].start = f->directory[i].position;
+		extents[cnt].end = f->directory[i].position
+		                 + f->directory[i].size;
+		++cnt;
+	}
+	extents[cnt].start = f->header.table_offset;
+	extents[cnt].end = f->header.table_offset
+	                 + f->header.num_lumps * WAD_FILE_ENTRY_LEN;
+
+	return cnt + 1;
+}
+
+// Called whenever the header is changed to point to a new directory.
+static void PinDirectory(struct wad_file *f)
+{
+	struct wad_extent *extents = checked_calloc(
+		f->num_pinned + f->num_lumps + 1, sizeof(struct wad_extent));
+	unsigned int cnt;
+
+	memcpy(extents, f->pinned, f->num_pinned * sizeof(struct wad_extent));
+	cnt = AddDirectoryExtents(f, extents, f->num_pinned);
+
+	free(f->pinned);
+	f->num_pinned = MergeExtents(extents, cnt);
+	f->pinned = checked_realloc(extents, (f->num_pinned + 1)
+	                                     * sizeof(struct wad_extent));
+	f->free_extents_stale = true;
+}
+
+static void UnpinAll(struct wad_file *f)
+{
+	free(f->pinned);
+	f->pinned = NULL;
+	f->num_pinned = 0;
+	f->free_extents_stale = true;
+}
+
+static void BuildFreeExtents(struct wad_file *f)
+{
+	struct wad_extent *used = checked_calloc(
+		f->num_pinned + f->num_lumps + 2, sizeof(struct wad_extent));
+	uint32_t pos = sizeof(struct wad_file_header);
+	unsigned int i, cnt;
+
+	memcpy(used, f->pinned, f->num_pinned * sizeof(struct wad_extent));
+	cnt = AddDirectoryExtents(f, used, f->num_pinned);
+	cnt = MergeExtents(used, cnt);
+
+	free(f->free_extents);
+	f->free_extents = checked_calloc(cnt + 1, sizeof(struct wad_extent));
+	f->num_free_extents = 0;
+
+	// Everything between the used extents is free, up to write_pos.
+	// Anything past write_pos is overwritten by appending anyway.
+	for (i = 0; i <= cnt && pos < f->write_pos; i++) {
+		uint32_t end = i < cnt ? used[i].start : f->write_pos;
+
+		end = min(end, f->write_pos);
+		if (end > pos) {
+			f->free_extents[f->num_free_extents].start = pos;
+			f->free_extents[f->num_free_extents].end = end;
+			++f->num_free_extents;
+		}
+		if (i < cnt) {
+			pos = max(pos, used[i].end);
+		}
+	}
+
+	free(used);
+	f->free_extents_stale = false;
+}
+
+static bool HaveFreeExtents(struct wad_file *f)
+{
+	if (f->free_extents_stale) {
+		BuildFreeExtents(f);
+	}
+	return f->num_free_extents > 0;
+}
+
+// Finds the smallest hole that will fit len bytes and takes space from it.
+// Returns false if there is no hole big enough.
+static bool AllocateExtent(struct wad_file *f, uint32_t len, uint32_t *pos)
+{
+	struct wad_extent *best = NULL, *ext;
+	unsigned int i;
+
+	if (!HaveFreeExtents(f)) {
+		return false;
+	}
+
+	for (i = 0; i < f->num_free_extents; i++) {
+		ext = &f->free_extents[i];
+		if (ext->end - ext->start >= len
+		 && (best == NULL
+		  || ext->end - ext->start < best->end - best->start)) {
+			best = ext;
+		}
+	}
+	if (best == NULL) {
+		return false;
+	}
+
+	*pos = best->start;
+	best->start += len;
+	if (best->start == best->end) {
+		memmove(best, best + 1, (f->free_extents + f->num_free_extents
+		                         - best - 1) * sizeof(struct wad_extent));
+		--f->num_free_extents;
+	}
+
+	return true;
+}
+
 // Just creates an empty WAD file.
 bool W_CreateFile(const char *filename)
 {
@@ -102,64 +725,130 @@ bool W_CreateFile(const char *filename)
 	return result;
 }
 
+static void UnmapFile(struct wad_file *f)
+{
+	if (f->map != NULL) {
+		munmap(f->map, f->map_len);
+		f->map = NULL;
+		f->map_len = 0;
+	}
+}
+
+// (Re)map the whole file at its current size.
+static void MapFile(struct wad_file *f)
+{
+	struct stat s;
+	void *map;
+
+	UnmapFile(f);
+
+	if (fstat(f->fd, &s) != 0 || s.st_size <= 0) {
+		return;
+	}
+
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	f->map = map;
+	f->map_len = s.st_size;
+}
+
+// Returns a pointer to the given range of the file through the mapping, or
+// NULL if it is not (or cannot be) mapped.
+static const uint8_t *MapRange(struct wad_file *f, size_t start, size_t len)
+{
+	if (f->need_flush) {
+		vfflush(f->vfs);
+		f->need_flush = false;
+	}
+
+	// If the range lies past the end of the mapping then the file has
+	// grown since it was mapped. We can only replace the mapping if
+	// nobody is still reading from the old one.
+	if (f->map == NULL || start + len > f->map_len) {
+		if (f->lump_open_count > 0) {
+			return NULL;
+		}
+		MapFile(f);
+		if (f->map == NULL || start + len > f->map_len) {
+			return NULL;
+		}
+	}
+
+	return f->map + start;
+}
+
 // Read WAD directory based on wf->header.table_offet.
 // If there is a current directory, it is replaced.
-#define LOOKAHEAD 30
 static int ReadDirectory(struct wad_file *wf)
 {
 	struct wad_file_entry *new_directory;
-	size_t new_num_lumps;
-	int i, j, k, old_lump_index, first_change;
+	struct header_cache_entry *ce;
+	const uint8_t *dir_data;
+	uint8_t *dir_buf = NULL;
+	size_t new_num_lumps, dir_len;
+	int i, first_change;
 
 	new_num_lumps = wf->header.num_lumps;
 	first_change = new_num_lumps;
-	assert(vfseek(wf->vfs, wf->header.table_offset, SEEK_SET) == 0);
-	new_directory = checked_calloc(
-		new_num_lumps, sizeof(struct wad_file_entry));
 
-	for (i = 0, j = 0; i < new_num_lumps; i++) {
-		struct wad_file_entry *ent = &new_directory[i], *oldent;
-		if (vfread(&ent->position, 4, 1, wf->vfs) != 1
-		 || vfread(&ent->size, 4, 1, wf->vfs) != 1
-		 || vfread(&ent->name, 8, 1, wf->vfs) != 1) {
-			free(new_directory);
+	// The whole directory is read in one go, straight out of the
+	// mapping if we can.
+	dir_len = new_num_lumps * WAD_FILE_ENTRY_LEN;
+	dir_data = MapRange(wf, wf->header.table_offset, dir_len);
+	if (dir_data == NULL) {
+		dir_buf = checked_malloc(dir_len + 1);
+		if (vfseek(wf->vfs, wf->header.table_offset, SEEK_SET) != 0
+		 || vfread(dir_buf, 1, dir_len, wf->vfs) != dir_len) {
+			free(dir_buf);
 			return -1;
 		}
+		dir_data = dir_buf;
+	}
+
+	new_directory = checked_calloc(
+		new_num_lumps, sizeof(struct wad_file_entry));
+
+	for (i = 0; i < new_num_lumps; i++) {
+		struct wad_file_entry *ent = &new_directory[i];
+		const uint8_t *raw = dir_data + i * WAD_FILE_ENTRY_LEN;
+
+		memcpy(&ent->position, raw, 4);
+		memcpy(&ent->size, raw + 4, 4);
+		memcpy(ent->name, raw + 8, 8);
 		SwapEntry(ent);
 
 		// We always assign a new serial number, but the
 		// snapshotting code may override it back to an old
 		// version.
 		ent->serial_no = NewSerialNo();
-
-		// As an optimization, look ahead into the old directory
-		// and see if we find the same lump. If we do, we can
-		// skip having to read the lump header again.
-		old_lump_index = -1;
-		oldent = NULL;
-		for (k = j; k < min(j + LOOKAHEAD, wf->num_lumps); k++) {
-			oldent = &wf->directory[k];
-			if (ent->position == oldent->position
-			 && ent->size == oldent->size) {
-				old_lump_index = k;
-				break;
-			}
+		// The snapshotting code restores old serial numbers, but
+		// the data may since have been overwritten in place (new
+		// writes start from the old EOF), so it always gets a new
+		// data generation.
+		ent->data_gen = NewDataGen();
+
+		// Lump headers are read on demand, but we may have read
+		// this one already.
+		if (ent->size == 0) {
+			ent->have_lump_header = true;
+			continue;
 		}
-		if (old_lump_index == -1) {
-			long old_pos = vftell(wf->vfs);
-			ReadLumpHeader(wf, ent);
-			vfseek(wf->vfs, old_pos, SEEK_SET);
-		} else {
-			// We got a match!
-			memcpy(ent->lump_header, oldent->lump_header,
-			       LUMP_HEADER_LEN);
-			j = old_lump_index + 1;
+		ce = FindCachedHeader(wf, HeaderCacheKey(ent));
+		if (ce != NULL) {
+			memcpy(ent->lump_header, ce->header, LUMP_HEADER_LEN);
+			ent->have_lump_header = true;
 		}
 	}
 
+	free(dir_buf);
 	free(wf->directory);
 	wf->directory = new_directory;
 	wf->num_lumps = new_num_lumps;
+	wf->name_index_stale = true;
+	wf->section_map_stale = true;
 	return first_change;
 }
 
@@ -168,11 +857,12 @@ struct wad_file *W_OpenFile(const char *filename)
 	struct wad_file *result;
 	bool readonly = false;
 	VFILE *vfs;
+	FILE *fs;
 
-	vfs = vfwrapfile(fopen(filename, "r+"));
-	if (vfs == NULL) {
-		vfs = vfwrapfile(fopen(filename, "r"));
-		if (vfs == NULL) {
+	fs = fopen(filename, "r+");
+	if (fs == NULL) {
+		fs = fopen(filename, "r");
+		if (fs == NULL) {
 			return NULL;
 		}
 		readonly = true;
@@ -180,9 +870,14 @@ struct wad_file *W_OpenFile(const char *filename)
 
 	result = checked_calloc(1, sizeof(struct wad_file));
 	result->readonly = readonly;
-	result->vfs = vfs;
+	// Mapping the file would bypass a simulated slow filesystem.
+	result->fd = vfslowio() ? -1 : fileno(fs);
+	result->vfs = vfs = vfwrapfile(fs);
+	vfsetname(vfs, filename);
 	result->directory = NULL;
 	result->num_lumps = 0;
+	W_SetSyncMode(result, default_sync_mode, default_sync_commits,
+	              default_sync_secs);
 
 	if (vfread(&result->header, sizeof(struct wad_file_header), 1, vfs) != 1
 	 || (strncmp(result->header.id, "IWAD", 4) != 0
@@ -198,10 +893,12 @@ struct wad_file *W_OpenFile(const char *filename)
 		return NULL;
 	}
 	result->write_pos = vftell(result->vfs);
+	MapFile(result);
 	if (ReadDirectory(result) < 0) {
 		W_CloseFile(result);
 		return NULL;
 	}
+	PinDirectory(result);
 
 	return result;
 }
@@ -225,10 +922,16 @@ int W_GetNumForName(struct wad_file *f, const char *name)
 {
 	int i;
 
-	for (i = f->num_lumps - 1; i >= 0; i--) {
+	if (f->name_index_stale) {
+		RebuildNameIndex(f);
+	}
+
+	i = f->name_buckets[NameHash(name) % f->num_name_buckets];
+	while (i >= 0) {
 		if (!strncasecmp(f->directory[i].name, name, 8)) {
 			return i;
 		}
+		i = f->name_chain[i];
 	}
 
 	return -1;
@@ -251,11 +954,21 @@ void W_CloseFile(struct wad_file *f)
 	// undo them all, the file will be precisely restored to its
 	// original contents.
 	// TODO: Gate this on whether we have ever called W_CommitChanges
+	UnmapFile(f);
+	if (f->header_stale) {
+		W_SyncFile(f);
+	}
 	if (!f->readonly && vfseek(f->vfs, f->write_pos, SEEK_SET) == 0) {
 		vftruncate(f->vfs);
 	}
 	vfclose(f->vfs);
 	free(f->directory);
+	free(f->name_buckets);
+	free(f->name_chain);
+	free(f->section_map);
+	free(f->pinned);
+	free(f->free_extents);
+	ClearHeaderCache(f);
 	free(f);
 }
 
@@ -266,7 +979,7 @@ void W_AddEntries(struct wad_file *f, unsigned int before_index,
 	struct wad_file_entry *ent;
 
 	assert(!f->readonly);
-	assert(f->current_write_lump == NULL);
+	assert(f->num_writers == 0);
 	assert(before_index <= f->num_lumps);
 
 	// We need to rearrange both the WAD directory and the lump headers
@@ -284,10 +997,15 @@ void W_AddEntries(struct wad_file *f, unsigned int before_index,
 		ent->position = 0;
 		ent->size = 0;
 		ent->serial_no = NewSerialNo();
+		ent->data_gen = NewDataGen();
 		snprintf(ent->name, 8, "UNNAMED");
 		memset(&ent->lump_header, 0, LUMP_HEADER_LEN);
+		ent->have_lump_header = true;
 	}
+	f->name_index_stale = true;
 	f->dirty = true;
+	SectionMapInsert(f, before_index, count);
+	RecordChange(f, WAD_CHANGE_INSERT, before_index, count);
 }
 
 void W_DeleteEntry(struct wad_file *f, unsigned int index)
@@ -298,14 +1016,17 @@ void W_DeleteEntry(struct wad_file *f, unsigned int index)
 void W_DeleteEntries(struct wad_file *f, unsigned int index, unsigned int cnt)
 {
 	assert(!f->readonly);
-	assert(f->current_write_lump == NULL);
+	assert(f->num_writers == 0);
 	assert(index <= f->num_lumps);
 	assert(cnt <= f->num_lumps);
 	assert(index + cnt <= f->num_lumps);
+	SectionMapDelete(f, index, cnt);
 	memmove(&f->directory[index], &f->directory[index + cnt],
 	        (f->num_lumps - index - cnt) * sizeof(struct wad_file_entry));
 	f->num_lumps -= cnt;
+	f->name_index_stale = true;
 	f->dirty = true;
+	RecordChange(f, WAD_CHANGE_REMOVE, index, cnt);
 }
 
 void W_SetLumpName(struct wad_file *f, unsigned int index, const char *name)
@@ -313,19 +1034,51 @@ void W_SetLumpName(struct wad_file *f, unsigned int index, const char *name)
 	unsigned int i;
 	assert(!f->readonly);
 	assert(index < f->num_lumps);
-	for (i = 0; i < 8; i++) {
+	if (!f->name_index_stale) {
+		UnindexName(f, index);
+	}
+	if (IsSectionMarker(f->directory[index].name)
+	 || IsSectionMarker(name)) {
+		f->section_map_stale = true;
+	}
+	for (i = 0; i < 8; i++) {
 		f->directory[index].name[i] = toupper(name[i]);
 		if (name[i] == '\0') {
 			break;
 		}
 	}
+	if (!f->name_index_stale) {
+		IndexName(f, index);
+	}
 	f->dirty = true;
+	RecordChange(f, WAD_CHANGE_MODIFY, index, 1);
+}
+
+static void ReadLumpHeader(struct wad_file *f, unsigned int index)
+{
+	struct wad_file_entry *ent = &f->directory[index];
+	size_t bytes = min(ent->size, LUMP_HEADER_LEN);
+	const uint8_t *data;
+	size_t len;
+
+	data = W_MapLump(f, index, &len);
+	if (data != NULL) {
+		memcpy(ent->lump_header, data, bytes);
+	} else {
+		assert(vfseek(f->vfs, ent->position, SEEK_SET) == 0);
+		assert(vfread(&ent->lump_header, 1, bytes, f->vfs) == bytes);
+	}
+	ent->have_lump_header = true;
+	CacheHeader(f, ent);
 }
 
 size_t W_ReadLumpHeader(struct wad_file *f, unsigned int index,
                         uint8_t *buf, size_t buf_len)
 {
 	assert(index < f->num_lumps);
+	if (!f->directory[index].have_lump_header) {
+		ReadLumpHeader(f, index);
+	}
 	buf_len = min(buf_len, min(LUMP_HEADER_LEN, f->directory[index].size));
 	memcpy(buf, &f->directory[index].lump_header, buf_len);
 	return buf_len;
@@ -348,16 +1101,35 @@ static void LumpClosed(VFILE *fs, void *data)
 	--f->lump_open_count;
 }
 
+const uint8_t *W_MapLump(struct wad_file *f, unsigned int lump_index,
+                         size_t *len)
+{
+	struct wad_file_entry *ent;
+
+	assert(lump_index < f->num_lumps);
+
+	ent = &f->directory[lump_index];
+	*len = ent->size;
+	return MapRange(f, ent->position, ent->size);
+}
+
 VFILE *W_OpenLump(struct wad_file *f, unsigned int lump_index)
 {
+	const uint8_t *data;
 	VFILE *result;
 	long start, end;
+	size_t len;
 
 	assert(lump_index < f->num_lumps);
 
-	start = f->directory[lump_index].position;
-	end = start + f->directory[lump_index].size;
-	result = vfrestrict(f->vfs, start, end, 1);
+	data = W_MapLump(f, lump_index, &len);
+	if (data != NULL) {
+		result = vfopenmemview(data, len);
+	} else {
+		start = f->directory[lump_index].position;
+		end = start + f->directory[lump_index].size;
+		result = vfrestrict(f->vfs, start, end, 1);
+	}
 
 	++f->lump_open_count;
 	vfonclose(result, LumpClosed, f);
@@ -365,63 +1137,275 @@ VFILE *W_OpenLump(struct wad_file *f, unsigned int lump_index)
 	return result;
 }
 
-static void WriteLumpClosed(VFILE *fs, void *data)
+// Writes out lump data that was buffered in memory, into a hole if there
+// is one that it fits in. Returns the position it was written to.
+static uint32_t WriteLumpData(struct wad_file *f, const void *data,
+                              uint32_t size)
+{
+	uint32_t pos;
+
+	assert(!f->streaming);
+
+	if (size == 0 || !AllocateExtent(f, size, &pos)) {
+		pos = f->write_pos;
+	}
+	assert(vfseek(f->vfs, pos, SEEK_SET) == 0);
+	assert(vfwrite(data, 1, size, f->vfs) == size);
+	f->write_pos = max(f->write_pos, pos + size);
+
+	return pos;
+}
+
+// If the lump's data is in memory, it can be passed to save reading the
+// header back later; otherwise data is NULL.
+static void UpdateLumpEntry(struct wad_file *f, unsigned int index,
+                            uint32_t pos, uint32_t size, const uint8_t *data)
 {
 	struct wad_file_entry *ent;
-	struct wad_file *f = data;
+
+	assert(index < f->num_lumps);
+	ent = &f->directory[index];
+	ent->position = pos;
+	ent->size = size;
+	ent->data_gen = NewDataGen();
+	f->write_pos = max(f->write_pos, ent->position + ent->size);
+	f->dirty = true;
+	f->need_flush = true;
+	UncacheHeader(f, ent);
+	RecordChange(f, WAD_CHANGE_MODIFY, index, 1);
+
+	ent->have_lump_header = data != NULL;
+	if (data != NULL) {
+		memset(ent->lump_header, 0, LUMP_HEADER_LEN);
+		memcpy(ent->lump_header, data, min(size, LUMP_HEADER_LEN));
+		CacheHeader(f, ent);
+	}
+}
+
+static void WritePendingLumps(struct wad_file *f)
+{
+	struct pending_lump *p;
+	uint32_t pos;
+
+	while (f->pending != NULL) {
+		p = f->pending;
+		f->pending = p->next;
+		pos = WriteLumpData(f, p->data, p->size);
+		UpdateLumpEntry(f, p->index, pos, p->size, p->data);
+		free(p->data);
+		free(p);
+	}
+}
+
+static void BufferedLumpClosed(struct lump_writer *w, VFILE *fs, long size)
+{
+	struct wad_file *f = w->f;
+	struct pending_lump *p;
+	const void *data;
+	void *to_free;
+	size_t len;
+
+	assert(vfseek(fs, 0, SEEK_SET) == 0);
+	data = vfmapall(fs, &len, &to_free);
+	assert(to_free == NULL && len >= size);
+
+	if (!f->streaming) {
+		w->pos = WriteLumpData(f, data, size);
+	} else if (size > 0 && AllocateExtent(f, size, &w->pos)) {
+		assert(vfseek(f->vfs, w->pos, SEEK_SET) == 0);
+		assert(vfwrite(data, 1, size, f->vfs) == size);
+	} else {
+		// We can't append to the file while another lump is being
+		// streamed to the end of it, so the data has to wait until
+		// that lump is closed.
+		p = checked_calloc(1, sizeof(struct pending_lump));
+		p->index = w->index;
+		p->data = checked_malloc(size + 1);
+		memcpy(p->data, data, size);
+		p->size = size;
+		p->next = f->pending;
+		f->pending = p;
+		return;
+	}
+
+	UpdateLumpEntry(f, w->index, w->pos, size, data);
+}
+
+static void WriteLumpClosed(VFILE *fs, void *data)
+{
+	struct lump_writer *w = data;
+	struct wad_file *f = w->f;
 	long size;
 
-	assert(f->current_write_lump == fs);
+	assert(f->num_writers > 0);
 	assert(f->lump_open_count > 0);
-	f->current_write_lump = NULL;
+	--f->num_writers;
 	--f->lump_open_count;
 
-	// New size of lump is the offset within the restricted VFILE.
+	// New size of lump is the offset within the VFILE.
 	size = vftell(fs);
-	assert(f->current_write_index < f->num_lumps);
-	ent = &f->directory[f->current_write_index];
-	ent->size = (unsigned int) size;
-	f->write_pos = ent->position + ent->size;
-	f->dirty = true;
 
-	ReadLumpHeader(f, ent);
+	switch (w->mode) {
+		case WRITE_STREAM:
+			UpdateLumpEntry(f, w->index, w->pos, size, NULL);
+			f->streaming = false;
+			WritePendingLumps(f);
+			break;
+
+		case WRITE_RESERVED:
+			UpdateLumpEntry(f, w->index, w->pos, size, NULL);
+			break;
+
+		case WRITE_BUFFERED:
+			BufferedLumpClosed(w, fs, size);
+			break;
+	}
+
+	free(w);
 }
 
-VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
+static VFILE *OpenWriter(struct wad_file *f, unsigned int lump_index,
+                         enum lump_write_mode mode, uint32_t pos,
+                         uint32_t len)
 {
+	struct lump_writer *w;
 	VFILE *result;
 
 	assert(!f->readonly);
 	assert(lump_index < f->num_lumps);
-	assert(f->current_write_lump == NULL);
 
-	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
-	f->directory[lump_index].position = (unsigned int) f->write_pos;
+	switch (mode) {
+		case WRITE_STREAM:
+			assert(!f->streaming);
+			f->streaming = true;
+			result = vfrestrict(f->vfs, pos, -1, 0);
+			break;
 
-	result = vfrestrict(f->vfs, f->write_pos, -1, 0);
-	f->current_write_lump = result;
-	f->current_write_index = lump_index;
-	++f->lump_open_count;
+		case WRITE_RESERVED:
+			result = vfrestrict(f->vfs, pos, pos + len, 0);
+			break;
+
+		default:
+			result = vfopenmem(NULL, 0);
+			break;
+	}
 
-	vfonclose(result, WriteLumpClosed, f);
+	w = checked_calloc(1, sizeof(struct lump_writer));
+	w->f = f;
+	w->index = lump_index;
+	w->mode = mode;
+	w->pos = pos;
+
+	++f->num_writers;
+	++f->lump_open_count;
+	vfonclose(result, WriteLumpClosed, w);
 
 	return result;
 }
 
+VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index)
+{
+	// If there are holes in the file then the new data might fit in one,
+	// but we don't know how big it will be until it has been written.
+	// So write into a buffer and decide where it goes when it's closed.
+	// We also have to buffer if another lump is streaming to the end of
+	// the file already.
+	if (f->streaming || HaveFreeExtents(f)) {
+		return OpenWriter(f, lump_index, WRITE_BUFFERED, 0, 0);
+	}
+
+	return OpenWriter(f, lump_index, WRITE_STREAM, f->write_pos, 0);
+}
+
+VFILE *W_OpenLumpRewriteSized(struct wad_file *f, unsigned int lump_index,
+                              uint32_t size)
+{
+	uint32_t pos;
+
+	if (size > 0 && AllocateExtent(f, size, &pos)) {
+		return OpenWriter(f, lump_index, WRITE_RESERVED, pos, size);
+	} else if (f->streaming) {
+		return OpenWriter(f, lump_index, WRITE_BUFFERED, 0, 0);
+	}
+
+	// Set aside space at the end of the file.
+	pos = f->write_pos;
+	f->write_pos += size;
+	return OpenWriter(f, lump_index, WRITE_RESERVED, pos, size);
+}
+
+static bool SyncDue(struct wad_file *f)
+{
+	switch (f->sync_mode) {
+		case WAD_SYNC_EVERY_COMMIT:
+			return true;
+
+		case WAD_SYNC_PERIODIC:
+			return f->unsynced_commits >= f->sync_commits
+			    || time(NULL) - f->last_sync >= f->sync_secs;
+
+		default:
+			return false;
+	}
+}
+
+void W_SyncFile(struct wad_file *f)
+{
+	if (f->readonly) {
+		return;
+	}
+
+	vfsync(f->vfs);
+	WriteHeader(f);
+	f->header_stale = false;
+	f->unsynced_commits = 0;
+	f->last_sync = time(NULL);
+}
+
+void W_SetSyncMode(struct wad_file *f, enum wad_sync_mode mode,
+                   unsigned int commits, unsigned int secs)
+{
+	f->sync_mode = mode;
+	f->sync_commits = commits;
+	f->sync_secs = secs;
+	f->last_sync = time(NULL);
+	if (mode == WAD_SYNC_EVERY_COMMIT && f->header_stale) {
+		W_SyncFile(f);
+	}
+}
+
+void W_SetDefaultSyncMode(enum wad_sync_mode mode, unsigned int commits,
+                          unsigned int secs)
+{
+	default_sync_mode = mode;
+	default_sync_commits = commits;
+	default_sync_secs = secs;
+}
+
 static void WriteDirectory(struct wad_file *f)
 {
+	size_t dir_len = f->num_lumps * WAD_FILE_ENTRY_LEN;
+	uint8_t *dir_buf = checked_malloc(dir_len + 1);
 	int i;
 
-	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
+	// The directory is written at write_pos, so nothing else can be
+	// writing there.
+	assert(f->num_writers == 0);
 
 	for (i = 0; i < f->num_lumps; i++) {
 		struct wad_file_entry ent = f->directory[i];
+		uint8_t *raw = dir_buf + i * WAD_FILE_ENTRY_LEN;
+
 		SwapEntry(&ent);
-		assert(vfwrite(&ent.position, 4, 1, f->vfs) == 1 &&
-		       vfwrite(&ent.size, 4, 1, f->vfs) == 1 &&
-		       vfwrite(&ent.name, 8, 1, f->vfs) == 1);
+		memcpy(raw, &ent.position, 4);
+		memcpy(raw + 4, &ent.size, 4);
+		memcpy(raw + 8, ent.name, 8);
 	}
 
+	assert(vfseek(f->vfs, f->write_pos, SEEK_SET) == 0);
+	assert(vfwrite(dir_buf, 1, dir_len, f->vfs) == dir_len);
+	free(dir_buf);
+
 	// Update header to point to new directory.
 	f->header.table_offset = f->write_pos;
 	f->header.num_lumps = f->num_lumps;
@@ -429,10 +1413,17 @@ static void WriteDirectory(struct wad_file *f)
 	// Save the current EOF. If we roll back to the previous directory,
 	// we can truncate the file here.
 	f->write_pos = vftell(f->vfs);
+	f->need_flush = true;
 
-	vfsync(f->vfs);
-	WriteHeader(f);
+	PinDirectory(f);
 	f->dirty = false;
+
+	++f->unsynced_commits;
+	if (SyncDue(f)) {
+		W_SyncFile(f);
+	} else {
+		f->header_stale = true;
+	}
 }
 
 void W_SwapEntries(struct wad_file *f, unsigned int l1, unsigned int l2)
@@ -445,13 +1436,28 @@ void W_SwapEntries(struct wad_file *f, unsigned int l1, unsigned int l2)
 		return;
 	}
 
-	assert(f->current_write_lump == NULL);
+	assert(f->num_writers == 0);
 	assert(l1 < f->num_lumps);
 	assert(l2 < f->num_lumps);
+	if (!f->name_index_stale) {
+		UnindexName(f, l1);
+		UnindexName(f, l2);
+	}
+	// Ordinary lumps take on the section of wherever they are moved to.
+	if (IsSectionMarker(f->directory[l1].name)
+	 || IsSectionMarker(f->directory[l2].name)) {
+		f->section_map_stale = true;
+	}
 	tmp = f->directory[l1];
 	f->directory[l1] = f->directory[l2];
 	f->directory[l2] = tmp;
+	if (!f->name_index_stale) {
+		IndexName(f, l1);
+		IndexName(f, l2);
+	}
 	f->dirty = true;
+	RecordChange(f, WAD_CHANGE_MODIFY, l1, 1);
+	RecordChange(f, WAD_CHANGE_MODIFY, l2, 1);
 }
 
 bool W_NeedCommit(struct wad_file *f)
@@ -461,23 +1467,174 @@ bool W_NeedCommit(struct wad_file *f)
 
 void W_CommitChanges(struct wad_file *f)
 {
-	if (f->readonly || !f->dirty) {
+	if (!W_NeedCommit(f)) {
 		return;
 	}
 
 	WriteDirectory(f);
 }
 
+static bool RewriteAllLumps(struct progress_window *progress,
+                            struct wad_file *f)
+{
+	VFILE *lump;
+	uint32_t new_pos;
+	int i;
+
+	if (vfseek(f->vfs, f->write_pos, SEEK_SET) != 0) {
+		return false;
+	}
+
+	for (i = 0; i < f->num_lumps; i++) {
+		new_pos = vftell(f->vfs);
+		lump = W_OpenLump(f, i);
+		if (lump == NULL) {
+			return false;
+		}
+		if (vfcopy(lump, f->vfs) != 0) {
+			return false;
+		}
+		vfclose(lump);
+		f->directory[i].position = new_pos;
+		UI_UpdateProgressWindow(progress, "");
+	}
+
+	f->write_pos = vftell(f->vfs);
+	WriteDirectory(f);
+	return true;
+}
+
+// Original strategy for compacting: first move all the existing data to the
+// end of the file so that it is out of the way. Once this is complete and
+// the directory has been updated to point to the new locations, move all
+// the data back again to the beginning of the file. This copies everything
+// twice, but it never overwrites data that the on-disk directory refers to.
+static bool CompactTwoPass(struct wad_file *f)
+{
+	struct progress_window progress;
+
+	UI_InitProgressWindow(&progress, f->num_lumps * 2, "Compacting WAD");
+
+	// Rewrite the whole file's contents to its end.
+	if (!RewriteAllLumps(&progress, f)) {
+		return false;
+	}
+
+	// Now seek back to the start of file and rewrite everything again.
+	f->write_pos = sizeof(struct wad_file_header);
+	return RewriteAllLumps(&progress, f);
+}
+
+#define COMPACT_BUF_LEN (1024 * 1024)
+
+// A contiguous block of lump data that gets moved as one piece. Lumps can
+// overlap or share data (eg. in WADs compressed by wadptr), so one extent
+// covers all lumps whose data overlaps.
+struct compact_extent {
+	uint32_t start, end, new_start;
+};
+
+struct compact_lump {
+	uint32_t start, end;
+	int index;
+	unsigned int extent;
+};
+
+static int CompareLumpsByPosition(const void *x, const void *y)
+{
+	const struct compact_lump *lx = x, *ly = y;
+
+	if (lx->start != ly->start) {
+		return lx->start < ly->start ? -1 : 1;
+	}
+	return lx->index - ly->index;
+}
+
+// Groups lumps into extents and works out where every extent should be
+// moved to so that they are packed together after the WAD header. Returns
+// the number of extents.
+static unsigned int FindExtents(struct wad_file *f, struct compact_lump *lumps,
+                                struct compact_extent *extents)
+{
+	struct compact_extent *ext = NULL;
+	uint32_t cursor = sizeof(struct wad_file_header);
+	unsigned int num_extents = 0;
+	int i;
+
+	for (i = 0; i < f->num_lumps; i++) {
+		lumps[i].start = f->directory[i].position;
+		lumps[i].end = f->directory[i].position + f->directory[i].size;
+		lumps[i].index = i;
+	}
+	qsort(lumps, f->num_lumps, sizeof(struct compact_lump),
+	      CompareLumpsByPosition);
+
+	for (i = 0; i < f->num_lumps; i++) {
+		if (ext == NULL || lumps[i].start >= ext->end) {
+			if (ext != NULL) {
+				cursor += ext->end - ext->start;
+			}
+			ext = &extents[num_extents];
+			ext->start = lumps[i].start;
+			ext->end = lumps[i].end;
+			ext->new_start = cursor;
+			++num_extents;
+		} else if (lumps[i].end > ext->end) {
+			ext->end = lumps[i].end;
+		}
+		lumps[i].extent = num_extents - 1;
+	}
+
+	return num_extents;
+}
+
+// Works out where every extent should be moved to. Returns false if the
+// layout is one that cannot be compacted in place.
+static bool PlanCompaction(struct wad_file *f, struct compact_lump *lumps,
+                           struct compact_extent *extents,
+                           unsigned int *num_extents, long file_len)
+{
+	struct compact_extent *ext;
+	int i;
+
+	*num_extents = FindExtents(f, lumps, extents);
+
+	// Data is only ever slid towards the start of the file, which we
+	// can't do if some lump lies inside the WAD header. We also don't
+	// want to start moving things if the directory points past EOF.
+	for (i = 0; i < *num_extents; i++) {
+		ext = &extents[i];
+		if (ext->end > file_len
+		 || (ext->end > ext->start && ext->start < ext->new_start)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Lumps can share data, so the minimum size is the header and directory,
+// plus the total size of all extents.
 static uint32_t MinimumWADSize(struct wad_file *f)
 {
+	struct compact_extent *extents;
+	struct compact_lump *lumps;
+	unsigned int i, num_extents;
 	size_t result = sizeof(struct wad_file_header)
 	              + WAD_FILE_ENTRY_LEN * f->num_lumps;
-	int i;
 
-	for (i = 0; i < f->num_lumps; i++) {
-		result += f->directory[i].size;
+	lumps = checked_calloc(f->num_lumps + 1, sizeof(struct compact_lump));
+	extents = checked_calloc(f->num_lumps + 1,
+	                         sizeof(struct compact_extent));
+	num_extents = FindExtents(f, lumps, extents);
+
+	for (i = 0; i < num_extents; i++) {
+		result += extents[i].end - extents[i].start;
 	}
 
+	free(lumps);
+	free(extents);
+
 	return result;
 }
 
@@ -495,71 +1652,279 @@ uint32_t W_NumJunkBytes(struct wad_file *f)
 	}
 }
 
-static bool RewriteAllLumps(struct progress_window *progress,
-                            struct wad_file *f)
+// To find lumps with identical contents, we hash every lump, then sort so
+// that lumps with the same size and hash are next to each other.
+struct lump_digest {
+	uint64_t hash;
+	uint32_t size, position;
+	int index;
+};
+
+static int CompareDigests(const void *x, const void *y)
 {
-	VFILE *lump;
-	uint32_t new_pos;
-	int i;
+	const struct lump_digest *dx = x, *dy = y;
+
+	if (dx->size != dy->size) {
+		return dx->size < dy->size ? -1 : 1;
+	} else if (dx->hash != dy->hash) {
+		return dx->hash < dy->hash ? -1 : 1;
+	} else if (dx->position != dy->position) {
+		return dx->position < dy->position ? -1 : 1;
+	}
+	return dx->index - dy->index;
+}
 
-	if (vfseek(f->vfs, f->write_pos, SEEK_SET) != 0) {
-		return false;
+// 64-bit FNV-1a.
+static uint64_t HashData(const uint8_t *data, size_t len)
+{
+	uint64_t result = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		result = (result ^ data[i]) * 0x100000001b3ULL;
 	}
 
+	return result;
+}
+
+static bool LumpsIdentical(struct wad_file *f, int l1, int l2)
+{
+	VFILE *in1 = W_OpenLump(f, l1), *in2 = W_OpenLump(f, l2);
+	const void *data1, *data2;
+	void *to_free1, *to_free2;
+	size_t len1, len2;
+	bool result;
+
+	data1 = vfmapall(in1, &len1, &to_free1);
+	data2 = vfmapall(in2, &len2, &to_free2);
+	result = len1 == len2 && !memcmp(data1, data2, len1);
+	free(to_free1);
+	free(to_free2);
+	vfclose(in1);
+	vfclose(in2);
+
+	return result;
+}
+
+// Finds lumps with identical contents, like wadptr does. Returns the number
+// of bytes that would be saved by having them share one copy of the data.
+// If merge=true, the directory is updated so that they do.
+static uint32_t FindDuplicates(struct wad_file *f, bool merge)
+{
+	struct lump_digest *digests;
+	uint32_t result = 0, target = 0;
+	const void *data;
+	void *to_free;
+	size_t len;
+	VFILE *in;
+	int i, j, group = 0, *reps, num_reps = 0;
+
+	digests = checked_calloc(f->num_lumps + 1, sizeof(struct lump_digest));
 	for (i = 0; i < f->num_lumps; i++) {
-		new_pos = vftell(f->vfs);
-		lump = W_OpenLump(f, i);
-		if (lump == NULL) {
-			return false;
+		in = W_OpenLump(f, i);
+		data = vfmapall(in, &len, &to_free);
+		digests[i].hash = HashData(data, len);
+		digests[i].size = f->directory[i].size;
+		digests[i].position = f->directory[i].position;
+		digests[i].index = i;
+		free(to_free);
+		vfclose(in);
+	}
+	qsort(digests, f->num_lumps, sizeof(struct lump_digest),
+	      CompareDigests);
+
+	// Lumps with the same size and hash form a group. Usually every
+	// lump in a group is identical, but a hash collision can put lumps
+	// with different contents in the same group, so we keep a list of
+	// representatives with distinct contents and compare against all
+	// of them.
+	reps = checked_calloc(f->num_lumps + 1, sizeof(int));
+	for (i = 0; i < f->num_lumps; i++) {
+		struct lump_digest *d = &digests[i];
+
+		if (d->size != digests[group].size
+		 || d->hash != digests[group].hash) {
+			group = i;
+			num_reps = 0;
 		}
-		if (vfcopy(lump, f->vfs) != 0) {
+		// Empty lumps have nothing to share.
+		if (d->size == 0) {
+			continue;
+		}
+		// Lumps at the same position are sorted together, so we only
+		// need to compare the data once for each position.
+		if (i == group || d->position != digests[i - 1].position) {
+			target = d->position;
+			for (j = 0; j < num_reps; j++) {
+				if (LumpsIdentical(f, digests[reps[j]].index,
+				                   d->index)) {
+					target = digests[reps[j]].position;
+					result += d->size;
+					break;
+				}
+			}
+			if (j == num_reps) {
+				reps[num_reps] = i;
+				++num_reps;
+			}
+		}
+		if (merge && target != d->position) {
+			f->directory[d->index].position = target;
+			f->dirty = true;
+		}
+	}
+
+	free(reps);
+	free(digests);
+	return result;
+}
+
+uint32_t W_NumDuplicateBytes(struct wad_file *f)
+{
+	return FindDuplicates(f, false);
+}
+
+// Moves data towards the start of the file. Because to < from, and we copy
+// in ascending order, we never overwrite data that we have yet to read.
+// *moved is set to the number of bytes that were successfully moved.
+static bool MoveData(struct wad_file *f, uint8_t *buf, uint32_t from,
+                     uint32_t to, uint32_t len, uint32_t *moved)
+{
+	uint32_t chunk;
+
+	assert(to < from);
+
+	for (*moved = 0; *moved < len; *moved += chunk) {
+		chunk = min(len - *moved, COMPACT_BUF_LEN);
+		if (vfseek(f->vfs, from + *moved, SEEK_SET) != 0
+		 || vfread(buf, 1, chunk, f->vfs) != chunk
+		 || vfseek(f->vfs, to + *moved, SEEK_SET) != 0
+		 || vfwrite(buf, 1, chunk, f->vfs) != chunk) {
 			return false;
 		}
-		vfclose(lump);
-		f->directory[i].position = new_pos;
-		UI_UpdateProgressWindow(progress, "");
 	}
 
-	f->write_pos = vftell(f->vfs);
-	WriteDirectory(f);
 	return true;
 }
 
-bool W_CompactWAD(struct wad_file *f)
+// Called if we fail partway through CompactInPlace(). Lumps in extents that
+// were moved must be pointed at their new locations, otherwise the old
+// ones will be overwritten next time we write anything. In the extent that
+// was being moved, lumps that were copied in full are pointed at the copy,
+// and the rest are left where they were; only lumps around the point where
+// we failed can have been lost.
+static void RecoverCompaction(struct wad_file *f, struct compact_lump *lumps,
+                              struct compact_extent *extents,
+                              unsigned int failed_extent, uint32_t moved)
+{
+	struct compact_extent *ext;
+	int i;
+
+	for (i = 0; i < f->num_lumps; i++) {
+		ext = &extents[lumps[i].extent];
+		if (lumps[i].extent < failed_extent
+		 || (lumps[i].extent == failed_extent
+		  && lumps[i].end - ext->start <= moved)) {
+			f->directory[lumps[i].index].position =
+				ext->new_start + lumps[i].start - ext->start;
+		}
+	}
+
+	// write_pos is still the old EOF, so the directory goes after all
+	// the data.
+	WriteDirectory(f);
+}
+
+// Compacts the WAD in a single pass: lumps are processed in order of their
+// position within the file and slid down to fill any gaps before them.
+// Lumps that are already in the right place are not touched at all. Unlike
+// CompactTwoPass(), the on-disk directory refers to overwritten data until
+// the new directory is written, so if we are interrupted (eg. by a crash)
+// the WAD is left damaged; the user is warned about this before we start.
+// Falls back to CompactTwoPass() for layouts that can't be handled this
+// way.
+static bool CompactInPlace(struct wad_file *f, long file_len)
 {
 	struct progress_window progress;
-	uint32_t min_size = MinimumWADSize(f);
+	struct compact_extent *extents, *ext;
+	struct compact_lump *lumps;
+	unsigned int num_extents;
+	uint8_t *buf = NULL;
+	bool result = false;
+	uint32_t moved;
+	int i;
 
-	assert(!f->readonly);
-	assert(f->current_write_lump == NULL);
+	lumps = checked_calloc(f->num_lumps + 1, sizeof(struct compact_lump));
+	extents = checked_calloc(f->num_lumps + 1,
+	                         sizeof(struct compact_extent));
 
-	// Is file length shorter than the minimum size already? (This
-	// can happen if the file was compressed with wadptr)
-	if (vfseek(f->vfs, 0, SEEK_END) != 0 || vftell(f->vfs) <= min_size) {
-		return false;
+	if (!PlanCompaction(f, lumps, extents, &num_extents, file_len)) {
+		result = CompactTwoPass(f);
+		goto fail;
 	}
 
-	// In compacting the WAD the end goal is to have all lumps at the
-	// start of the file (with no gaps), followed by the WAD directory,
-	// then the EOF. Step 1 is that we move all the existing data to the
-	// end of the file so that it is out of the way. Once this is
-	// complete and the directory has been updated to point to the new
-	// locations, step 2 is that we move all the data back again to the
-	// beginning of the file, then truncate it to the minimum size.
+	UI_InitProgressWindow(&progress, num_extents, "Compacting WAD");
+
+	for (i = 0; i < num_extents; i++) {
+		ext = &extents[i];
+		if (ext->new_start != ext->start && ext->end > ext->start) {
+			if (buf == NULL) {
+				buf = checked_malloc(COMPACT_BUF_LEN);
+			}
+			if (!MoveData(f, buf, ext->start, ext->new_start,
+			              ext->end - ext->start, &moved)) {
+				RecoverCompaction(f, lumps, extents, i, moved);
+				goto fail;
+			}
+		}
+		UI_UpdateProgressWindow(&progress, "");
+	}
 
-	// TODO: Compacting could be made more effective by reusing the code
-	// from wadptr.
+	for (i = 0; i < f->num_lumps; i++) {
+		ext = &extents[lumps[i].extent];
+		f->directory[lumps[i].index].position =
+			ext->new_start + lumps[i].start - ext->start;
+	}
 
-	UI_InitProgressWindow(&progress, f->num_lumps * 2, "Compacting WAD");
+	f->write_pos = sizeof(struct wad_file_header);
+	if (num_extents > 0) {
+		ext = &extents[num_extents - 1];
+		f->write_pos = ext->new_start + ext->end - ext->start;
+	}
+	WriteDirectory(f);
+	result = true;
 
-	// Rewrite the whole file's contents to its end.
-	if (!RewriteAllLumps(&progress, f)) {
+fail:
+	free(buf);
+	free(lumps);
+	free(extents);
+	return result;
+}
+
+static bool CompactWAD(struct wad_file *f, bool dedupe)
+{
+	long file_len;
+
+	// Point lumps with identical contents at a single copy of the data.
+	// The other copies become junk that is removed below.
+	if (dedupe) {
+		FindDuplicates(f, true);
+	}
+
+	// Is file length shorter than the minimum size already?
+	if (vfseek(f->vfs, 0, SEEK_END) != 0) {
+		return false;
+	}
+	file_len = vftell(f->vfs);
+	if (file_len <= MinimumWADSize(f)) {
 		return false;
 	}
 
-	// Now seek back to the start of file and rewrite everything again.
-	f->write_pos = sizeof(struct wad_file_header);
-	if (!RewriteAllLumps(&progress, f)) {
+	// In compacting the WAD the end goal is to have all lumps at the
+	// start of the file (with no gaps), followed by the WAD directory,
+	// then the EOF.
+
+	if (!CompactInPlace(f, file_len)) {
 		return false;
 	}
 
@@ -569,9 +1934,51 @@ bool W_CompactWAD(struct wad_file *f)
 	}
 	vftruncate(f->vfs);
 
+	// Everything has moved, so old snapshots can no longer be restored
+	// and only the new directory refers to valid data.
+	UnpinAll(f);
+	PinDirectory(f);
+
+	// The mapping now extends past the EOF; replace it if we can.
+	if (f->lump_open_count == 0) {
+		MapFile(f);
+	}
+
 	return true;
 }
 
+bool W_CompactWAD(struct wad_file *f, bool dedupe)
+{
+	enum wad_sync_mode saved_mode = f->sync_mode;
+	bool result;
+	int i;
+
+	assert(!f->readonly);
+	assert(f->num_writers == 0);
+
+	// Compaction overwrites old data, so the header on disk must always
+	// point to the latest directory.
+	if (f->header_stale) {
+		W_SyncFile(f);
+	}
+
+	// Lumps are moved around, so cached headers would end up keyed by
+	// the wrong positions. The directory keeps its own copies though.
+	ClearHeaderCache(f);
+
+	f->sync_mode = WAD_SYNC_EVERY_COMMIT;
+	result = CompactWAD(f, dedupe);
+	f->sync_mode = saved_mode;
+
+	for (i = 0; i < f->num_lumps; i++) {
+		if (f->directory[i].have_lump_header) {
+			CacheHeader(f, &f->directory[i]);
+		}
+	}
+
+	return result;
+}
+
 // We support Undo by just saving a snapshot of the WAD header. Every time
 // anything in the file changes, we write a new WAD directory. To undo, we
 // simply revert the WAD header to point back to the old directory. Redo is
@@ -581,30 +1988,39 @@ bool W_CompactWAD(struct wad_file *f)
 VFILE *W_SaveSnapshot(struct wad_file *wf)
 {
 	VFILE *result = vfopenmem(NULL, 0);
+	uint64_t *serials;
 	struct snapshot s;
 	int i;
 
 	s.header = wf->header;
 	s.eof = wf->write_pos;
 
-	assert(vfwrite(&s, sizeof(struct snapshot), 1, result) == 1);
+	serials = checked_calloc(wf->header.num_lumps + 1, sizeof(uint64_t));
 	for (i = 0; i < wf->header.num_lumps; i++) {
-		assert(vfwrite(&wf->directory[i].serial_no,
-		               sizeof(uint64_t), 1, result) == 1);
+		serials[i] = wf->directory[i].serial_no;
 	}
 
+	assert(vfwrite(&s, sizeof(struct snapshot), 1, result) == 1);
+	assert(vfwrite(serials, sizeof(uint64_t), wf->header.num_lumps,
+	               result) == wf->header.num_lumps);
+	free(serials);
+
 	assert(vfseek(result, 0, SEEK_SET) == 0);
 	wf->dirty = false;
 
 	return result;
 }
 
+// Restoring a snapshot is just a matter of reading back the old directory;
+// lump headers all come from the header cache if we have read them before.
 void W_RestoreSnapshot(struct wad_file *wf, VFILE *in)
 {
+	uint64_t *serials;
 	struct snapshot s;
 	int i;
 
 	assert(!wf->readonly);
+	assert(wf->num_writers == 0);
 	assert(vfread(&s, sizeof(struct snapshot), 1, in) == 1);
 	wf->header = s.header;
 	wf->write_pos = s.eof;
@@ -614,13 +2030,26 @@ void W_RestoreSnapshot(struct wad_file *wf, VFILE *in)
 	ReadDirectory(wf);
 
 	// Read back old serial numbers.
+	serials = checked_calloc(wf->header.num_lumps + 1, sizeof(uint64_t));
+	assert(vfread(serials, sizeof(uint64_t), wf->header.num_lumps, in)
+	       == wf->header.num_lumps);
 	for (i = 0; i < wf->header.num_lumps; i++) {
-		assert(vfread(&wf->directory[i].serial_no,
-		              sizeof(uint64_t), 1, in) == 1);
+		wf->directory[i].serial_no = serials[i];
 	}
+	free(serials);
 	vfclose(in);
 
-	WriteHeader(wf);
+	// New data gets written from the old EOF, overwriting any directory
+	// newer than this one, so the header must point here first. If
+	// there are unsynced commits, the directory we are restoring may not
+	// be on disk yet either, so we have to sync.
+	if (wf->header_stale) {
+		W_SyncFile(wf);
+	} else {
+		WriteHeader(wf);
+	}
 	wf->write_pos = s.eof;
+	wf->free_extents_stale = true;
 	wf->dirty = false;
+	wf->changes_overflow = true;
 }
@@ -32,7 +32,12 @@ struct wad_file_entry {
 	unsigned int size;
 	char name[8];
 	uint64_t serial_no;
+	// Changes whenever the lump's data may have changed, even if it is
+	// still at the same position and has the same size.
+	uint64_t data_gen;
+	// Lump headers are read lazily, by W_ReadLumpHeader().
 	uint8_t lump_header[LUMP_HEADER_LEN];
+	bool have_lump_header;
 };
 
 bool W_CreateFile(const char *filename);
@@ -44,8 +49,24 @@ struct wad_file_entry *W_GetDirectory(struct wad_file *f);
 int W_GetNumForName(struct wad_file *f, const char *name);
 unsigned int W_NumLumps(struct wad_file *f);
 VFILE *W_OpenLump(struct wad_file *f, unsigned int lump_index);
+
+// Returns a pointer to the lump's data in a read-only memory mapping of the
+// WAD, or NULL if the lump cannot be mapped (use W_OpenLump instead). The
+// pointer remains valid until the file is next modified or closed.
+const uint8_t *W_MapLump(struct wad_file *f, unsigned int lump_index,
+                         size_t *len);
+
+// Any number of lumps can be open for writing at once. Lumps can't be
+// added, deleted or moved until they have all been closed.
 VFILE *W_OpenLumpRewrite(struct wad_file *f, unsigned int lump_index);
 
+// Like W_OpenLumpRewrite, but space for the given number of bytes is set
+// aside immediately, so the data can be written directly into the file
+// even while other lumps are being written. No more than `size` bytes can
+// be written; writing fewer is fine, but the unused space is wasted.
+VFILE *W_OpenLumpRewriteSized(struct wad_file *f, unsigned int lump_index,
+                              uint32_t size);
+
 // Insert new WAD entries before the lump at the given index. If
 // `before_index == W_NumLumps()` then the new lumps are inserted at the
 // end of the directory.
@@ -57,18 +78,77 @@ void W_SetLumpName(struct wad_file *f, unsigned int index, const char *name);
 size_t W_ReadLumpHeader(struct wad_file *f, unsigned int index,
                         uint8_t *buf, size_t buf_len);
 uint32_t W_NumJunkBytes(struct wad_file *f);
+uint32_t W_NumDuplicateBytes(struct wad_file *f);
 void W_SwapEntries(struct wad_file *f, unsigned int l1, unsigned int l2);
 
+// Sections of the directory delimited by marker lumps, eg. F_START/F_END.
+enum wad_section {
+	WAD_SECTION_SPRITES,
+	WAD_SECTION_PATCHES,
+	WAD_SECTION_FLATS,
+	WAD_SECTION_COLORMAPS,
+	NUM_WAD_SECTIONS,
+};
+
+// Returns true if the given lump is between the start and end markers of
+// the given section.
+bool W_LumpInSection(struct wad_file *f, unsigned int index,
+                     enum wad_section section);
+
+enum wad_change_type {
+	WAD_CHANGE_INSERT,
+	WAD_CHANGE_REMOVE,
+	WAD_CHANGE_MODIFY,
+};
+
+// A range of directory entries that were inserted, removed or modified
+// (renamed, moved or rewritten).
+struct wad_change {
+	enum wad_change_type type;
+	unsigned int index, count;
+};
+
+// Returns the changes made to the directory since the last call, in the
+// order that they were made, and forgets them. The array is only valid
+// until the next change. Returns false if the changes could not all be
+// tracked (eg. after a snapshot is restored), in which case the whole
+// directory must be reread.
+bool W_TakeChanges(struct wad_file *f, const struct wad_change **changes,
+                   size_t *num_changes);
+
 // Must be called after any change to the file by above functions
 // (W_AddEntries, W_OpenLumpRewrite, etc.), otherwise the directory will
 // not be updated and the changes will be lost.
 bool W_NeedCommit(struct wad_file *f);
 void W_CommitChanges(struct wad_file *f);
 
+// Controls how often committed changes are synced to disk. Until they are,
+// the header on disk still points to the last synced directory, so a crash
+// loses the unsynced commits but never leaves the WAD inconsistent.
+enum wad_sync_mode {
+	// Sync on every W_CommitChanges (the default).
+	WAD_SYNC_EVERY_COMMIT,
+	// Sync after the given number of commits, or on the first commit
+	// once the given number of seconds have passed since the last sync.
+	WAD_SYNC_PERIODIC,
+	// Only sync when W_SyncFile is called or the file is closed.
+	WAD_SYNC_ON_CLOSE,
+};
+
+void W_SetSyncMode(struct wad_file *f, enum wad_sync_mode mode,
+                   unsigned int commits, unsigned int secs);
+void W_SyncFile(struct wad_file *f);
+
+// Sets the sync mode for files opened from now on.
+void W_SetDefaultSyncMode(enum wad_sync_mode mode, unsigned int commits,
+                          unsigned int secs);
+
 // Functions below this point take effect immediately and do not require
 // calling W_CommitChanges().
 
-bool W_CompactWAD(struct wad_file *f);
+// If dedupe=true, lumps with identical contents are also merged so that
+// they share a single copy of the data.
+bool W_CompactWAD(struct wad_file *f, bool dedupe);
 
 // Snapshotting functions for implementing undo/redo.
 VFILE *W_SaveSnapshot(struct wad_file *wf);
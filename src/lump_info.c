@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -24,8 +25,7 @@
 struct wad_file;
 
 struct lump_section {
-	const char *start1, *start2;
-	const char *end1, *end2;
+	enum wad_section section;
 };
 
 struct lump_type {
@@ -44,21 +44,34 @@ struct sized_lump {
 	const char *description;
 };
 
-const struct lump_section lump_section_sprites = {
-	"S_START", "SS_START", "S_END", "SS_END",
+// Lump types that have already been identified, keyed by serial number.
+// A lump keeps its serial number when it is renamed or rewritten, so we
+// also check that its name, data generation and section are the same as
+// before.
+struct cached_lump_type {
+	uint64_t serial_no;
+	uint64_t data_gen;
+	char name[8];
+	unsigned int sections;
+	const struct lump_type *type;
+	bool used;
 };
 
-const struct lump_section lump_section_patches = {
-	"P_START", "PP_START", "P_END", "PP_END",
-};
+#define LUMP_IN_FLATS      0x01
+#define LUMP_IN_COLORMAPS  0x02
 
-const struct lump_section lump_section_flats = {
-	"F_START", "FF_START", "F_END", "FF_END",
-};
+// Serial numbers are never reused, so entries for lumps that have gone
+// away are only dropped when the cache gets this big and is cleared.
+#define LUMP_TYPE_CACHE_MAX_SIZE  (1 << 16)
 
-const struct lump_section lump_section_colormaps = {
-	"C_START", "C_START", "C_END", "C_END",
-};
+// Open addressed hash table, with linear probing.
+static struct cached_lump_type *lump_type_cache;
+static unsigned int lump_type_cache_size, lump_type_cache_count;
+
+const struct lump_section lump_section_sprites = {WAD_SECTION_SPRITES};
+const struct lump_section lump_section_patches = {WAD_SECTION_PATCHES};
+const struct lump_section lump_section_flats = {WAD_SECTION_FLATS};
+const struct lump_section lump_section_colormaps = {WAD_SECTION_COLORMAPS};
 
 static const struct lump_description special_lumps[] = {
 	{"TINTTAB",   "Translucency table"},
@@ -105,26 +118,8 @@ static const struct sized_lump lumps_by_size[] = {
 bool LI_LumpInSection(struct wad_file *wf, unsigned int lump_index,
                       const struct lump_section *section)
 {
-	const struct wad_file_entry *dir = W_GetDirectory(wf);
-	int num_lumps = W_NumLumps(wf);
-	int i;
-
-	for (i = lump_index; i >= 0 && i < num_lumps; i--) {
-		if (!strncasecmp(dir[i].name, section->start1, 8)
-		 || !strncasecmp(dir[i].name, section->start2, 8)) {
-			break;
-		}
-	}
-	if (i < 0) {
-		return false;
-	}
-	for (i = lump_index + 1; i < num_lumps; i++) {
-		if (!strncasecmp(dir[i].name, section->end1, 8)
-		 || !strncasecmp(dir[i].name, section->end2, 8)) {
-			return true;
-		}
-	}
-	return false;
+	return lump_index < W_NumLumps(wf)
+	    && W_LumpInSection(wf, lump_index, section->section);
 }
 
 static const char *LookupDescription(const struct lump_description *table,
@@ -669,38 +664,135 @@ static const struct lump_type *lump_types[] = {
 	&lump_type_unknown,
 };
 
+static struct cached_lump_type *LumpTypeCacheSlot(uint64_t serial_no)
+{
+	unsigned int i;
+
+	i = ((serial_no * 0x9e3779b97f4a7c15ULL) >> 32)
+	  & (lump_type_cache_size - 1);
+	while (lump_type_cache[i].used
+	    && lump_type_cache[i].serial_no != serial_no) {
+		i = (i + 1) & (lump_type_cache_size - 1);
+	}
+
+	return &lump_type_cache[i];
+}
+
+static void ResizeLumpTypeCache(unsigned int new_size)
+{
+	struct cached_lump_type *old_cache = lump_type_cache;
+	unsigned int i, old_size = lump_type_cache_size;
+
+	lump_type_cache = checked_calloc(new_size,
+	                                 sizeof(struct cached_lump_type));
+	lump_type_cache_size = new_size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_cache[i].used) {
+			*LumpTypeCacheSlot(old_cache[i].serial_no) =
+				old_cache[i];
+		}
+	}
+
+	free(old_cache);
+}
+
+static void CacheLumpType(const struct wad_file_entry *ent,
+                          unsigned int sections, const struct lump_type *lt)
+{
+	struct cached_lump_type *c;
+
+	// Keep the table no more than 3/4 full.
+	if ((lump_type_cache_count + 1) * 4 > lump_type_cache_size * 3) {
+		if (lump_type_cache_size < LUMP_TYPE_CACHE_MAX_SIZE) {
+			ResizeLumpTypeCache(max(lump_type_cache_size * 2,
+			                        256));
+		} else {
+			memset(lump_type_cache, 0, lump_type_cache_size
+			       * sizeof(struct cached_lump_type));
+			lump_type_cache_count = 0;
+		}
+	}
+
+	c = LumpTypeCacheSlot(ent->serial_no);
+	if (!c->used) {
+		++lump_type_cache_count;
+	}
+	c->serial_no = ent->serial_no;
+	c->data_gen = ent->data_gen;
+	memcpy(c->name, ent->name, 8);
+	c->sections = sections;
+	c->type = lt;
+	c->used = true;
+}
+
+static const struct lump_type *FindCachedLumpType(
+	const struct wad_file_entry *ent, unsigned int sections)
+{
+	struct cached_lump_type *c;
+
+	if (lump_type_cache_size == 0) {
+		return NULL;
+	}
+
+	c = LumpTypeCacheSlot(ent->serial_no);
+	if (!c->used || c->data_gen != ent->data_gen
+	 || strncmp(c->name, ent->name, 8) != 0 || c->sections != sections) {
+		return NULL;
+	}
+
+	return c->type;
+}
+
 const struct lump_type *LI_IdentifyLump(struct wad_file *f,
                                         unsigned int lump_index)
 {
+	const struct lump_type *result;
 	struct wad_file_entry *ent;
+	unsigned int sections = 0;
 	uint8_t buf[8];
 	int i;
 
 	ent = &W_GetDirectory(f)[lump_index];
 
+	if (LI_LumpInSection(f, lump_index, &lump_section_flats)) {
+		sections |= LUMP_IN_FLATS;
+	}
+	if (LI_LumpInSection(f, lump_index, &lump_section_colormaps)) {
+		sections |= LUMP_IN_COLORMAPS;
+	}
+
+	result = FindCachedLumpType(ent, sections);
+	if (result != NULL) {
+		return result;
+	}
+
 	// Flats are a special case where we look at lump size but also
 	// check the section of the WAD; it must be between
 	// F_START/F_END markers.
 	if (ent->size >= 4096 && (ent->size % 64) == 0
-	 && LI_LumpInSection(f, lump_index, &lump_section_flats)) {
-		return &lump_type_flat;
-	}
-
-	if (ent->size > 0 && (ent->size % 256) == 0
-	 && LI_LumpInSection(f, lump_index, &lump_section_colormaps)) {
-		return &lump_type_colormap;
+	 && (sections & LUMP_IN_FLATS) != 0) {
+		result = &lump_type_flat;
+	} else if (ent->size > 0 && (ent->size % 256) == 0
+	        && (sections & LUMP_IN_COLORMAPS) != 0) {
+		result = &lump_type_colormap;
+	} else {
+		memset(buf, 0, sizeof(buf));
+		W_ReadLumpHeader(f, lump_index, buf, sizeof(buf));
+
+		for (i = 0; i < arrlen(lump_types); i++) {
+			if (lump_types[i]->check(ent, buf)) {
+				result = lump_types[i];
+				break;
+			}
+		}
 	}
 
-	memset(buf, 0, sizeof(buf));
-	W_ReadLumpHeader(f, lump_index, buf, sizeof(buf));
-
-	for (i = 0; i < arrlen(lump_types); i++) {
-		if (lump_types[i]->check(ent, buf)) {
-			return lump_types[i];
-		}
+	if (result != NULL) {
+		CacheLumpType(ent, sections, result);
 	}
 
-	return NULL;
+	return result;
 }
 
 const char *LI_DescribeLump(const struct lump_type *t, struct wad_file *f,
@@ -132,7 +132,7 @@ static void SwitchToASCII(void)
 	struct plaintext_pager_config *ptc = cfg->plaintext_config;
 
 	if (ptc == NULL) {
-		VFILE *in = vfopenmem(cfg->data, cfg->data_len);
+		VFILE *in = vfopenmemview(cfg->data, cfg->data_len);
 		ptc = checked_calloc(1, sizeof(struct plaintext_pager_config));
 		assert(P_InitPlaintextConfig(cfg->pc.title, false, ptc, in));
 		cfg->plaintext_config = ptc;
@@ -354,8 +354,14 @@ bool P_InitHexdumpConfig(const char *title, struct hexdump_pager_config *cfg,
 	cfg->specs_help.pc.title = NULL;
 	cfg->specs_pager_open = false;
 
-	cfg->data = vfreadall(input, &cfg->data_len);
-	vfclose(input);
+	// We keep the input open while the pager is running, since the data
+	// may point directly into it (eg. a memory-mapped WAD lump).
+	cfg->input = input;
+	cfg->data = vfmapall(input, &cfg->data_len, &cfg->data_buf);
+	if (cfg->data == NULL) {
+		vfclose(input);
+		return false;
+	}
 
 	SetBytesPerRecord(cfg, title);
 	SetColumns(cfg);
@@ -365,12 +371,13 @@ bool P_InitHexdumpConfig(const char *title, struct hexdump_pager_config *cfg,
 	cfg->pc.current_link = -1;
 	cfg->pc.current_column = 0;
 
-	return cfg->data != NULL;
+	return true;
 }
 
 void P_FreeHexdumpConfig(struct hexdump_pager_config *cfg)
 {
-	free(cfg->data);
+	free(cfg->data_buf);
+	vfclose(cfg->input);
 	if (cfg->specs_help.pc.title != NULL) {
 		P_FreeHelpConfig(&cfg->specs_help);
 		P_FreePager(&cfg->specs_pager);
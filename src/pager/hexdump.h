@@ -21,7 +21,9 @@
 
 struct hexdump_pager_config {
 	struct pager_config pc;
-	uint8_t *data;
+	VFILE *input;
+	const uint8_t *data;
+	void *data_buf;
 	size_t data_len;
 	void *plaintext_config;
 	int columns;
@@ -28,7 +28,7 @@ static void SwitchToHexdump(void)
 	struct hexdump_pager_config *hdc = cfg->hexdump_config;
 
 	if (hdc == NULL) {
-		VFILE *in = vfopenmem(cfg->data, cfg->data_len);
+		VFILE *in = vfopenmemview(cfg->data, cfg->data_len);
 		hdc = checked_calloc(1, sizeof(struct hexdump_pager_config));
 		assert(P_InitHexdumpConfig(cfg->pc.title, hdc, in));
 		cfg->hexdump_config = hdc;
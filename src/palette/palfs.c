@@ -63,10 +63,12 @@ static struct directory *PaletteFSOpenDir(void *dir,
 }
 
 static void PaletteFSRefresh(void *dir, struct directory_entry **entries,
-                             size_t *num_entries)
+                             size_t *num_entries, struct entry_names **names)
 {
 	struct palette_dir *pd = dir;
 	char *def_pal = PAL_ReadDefaultPointer();
+	const char *suffix;
+	size_t len;
 	int i;
 
 	VFS_Refresh(pd->inner);
@@ -85,14 +87,11 @@ static void PaletteFSRefresh(void *dir, struct directory_entry **entries,
 		}
 
 		ent->type = FILE_TYPE_PALETTE;
-		ent->name = checked_strdup(inner_ent->name);
-		*strstr(ent->name, ".png") = '\0';
-		if (!strcmp(inner_ent->name, def_pal)) {
-			char *old_name = ent->name;
-			ent->name = StringJoin("", old_name,
-			                       " [default]", NULL);
-			free(old_name);
-		}
+		len = strstr(inner_ent->name, ".png") - inner_ent->name;
+		suffix = !strcmp(inner_ent->name, def_pal) ? " [default]" : "";
+		ent->name = VFS_AllocEntryName(names, len + strlen(suffix));
+		memcpy(ent->name, inner_ent->name, len);
+		strcpy(ent->name + len, suffix);
 		ent->size = -1;
 		ent->serial_no = inner_ent->serial_no;
 
@@ -197,7 +196,8 @@ struct directory *PAL_OpenDirectory(struct directory *previous)
 	pd->previous = previous;
 	VFS_DirectoryRef(pd->previous);
 
-	PaletteFSRefresh(pd, &pd->dir.entries, &pd->dir.num_entries);
+	PaletteFSRefresh(pd, &pd->dir.entries, &pd->dir.num_entries,
+	                 &pd->dir.entry_names);
 
 	return &pd->dir;
 }
@@ -132,6 +132,7 @@ bool TX_InitLumpDir(struct lump_dir *dir, const struct lump_dir_funcs *funcs,
 	dir->dir.refcount = 1;
 	dir->dir.entries = NULL;
 	dir->dir.num_entries = 0;
+	dir->dir.entry_names = NULL;
 	dir->dir.readonly = parent->readonly;
 	dir->dir.parent_name = StringJoin("", "Back to ",
 	                                  PathBaseName(parent->path), NULL);
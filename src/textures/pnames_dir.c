@@ -31,7 +31,7 @@ struct pnames_dir {
 #define PNAMES(d) ((d)->dir.b.pn)
 
 static void PnamesDirRefresh(void *_dir, struct directory_entry **entries,
-                             size_t *num_entries)
+                             size_t *num_entries, struct entry_names **names)
 {
 	struct pnames_dir *dir = _dir;
 	struct directory_entry *new_entries;
@@ -40,10 +40,10 @@ static void PnamesDirRefresh(void *_dir, struct directory_entry **entries,
 	*num_entries = PNAMES(dir)->num_pnames;
 	new_entries = checked_calloc(*num_entries,
 	                             sizeof(struct directory_entry));
+	VFS_ReserveEntryNames(names, *num_entries * 9);
 	for (i = 0; i < *num_entries; i++) {
-		new_entries[i].name = checked_calloc(9, 1);
+		new_entries[i].name = VFS_AllocEntryName(names, 8);
 		memcpy(new_entries[i].name, PNAMES(dir)->pnames[i], 8);
-		new_entries[i].name[8] = '\0';
 
 		new_entries[i].type = FILE_TYPE_PNAME;
 		new_entries[i].size = 0;
@@ -37,7 +37,7 @@ struct texture_dir {
 #define PNAMES(dir) ((dir)->dir.b.pn)
 
 static void TextureDirRefresh(void *_dir, struct directory_entry **entries,
-                              size_t *num_entries)
+                              size_t *num_entries, struct entry_names **names)
 {
 	struct texture_dir *dir = _dir;
 	unsigned int i;
@@ -45,13 +45,13 @@ static void TextureDirRefresh(void *_dir, struct directory_entry **entries,
 	*num_entries = TEXTURES(dir)->num_textures;
 	*entries = checked_calloc(
 		TEXTURES(dir)->num_textures, sizeof(struct directory_entry));
+	VFS_ReserveEntryNames(names, TEXTURES(dir)->num_textures * 9);
 
 	for (i = 0; i < TEXTURES(dir)->num_textures; i++) {
 		struct directory_entry *ent = *entries + i;
 		ent->type = FILE_TYPE_TEXTURE;
-		ent->name = checked_calloc(9, 1);
+		ent->name = VFS_AllocEntryName(names, 8);
 		memcpy(ent->name, TEXTURES(dir)->textures[i]->name, 8);
-		ent->name[8] = '\0';
 		ent->size = 0;
 		ent->serial_no = TEXTURES(dir)->serial_nos[i];
 	}
@@ -18,6 +18,7 @@
 
 #include "ui/colors.h"
 #include "common.h"
+#include "fs/vfile.h"
 #include "ui/stack.h"
 #include "ui/pane.h"
 
@@ -258,6 +259,7 @@ static int TranslateSpecialKey(int key)
 static void HandleKeypress(void *_p, int key)
 {
 	const struct action **actions = UI_CurrentStack()->actions;
+	const char *old_op;
 	int i;
 
 	if (actions == NULL) {
@@ -270,7 +272,11 @@ static void HandleKeypress(void *_p, int key)
 		if (actions[i]->callback != NULL
 		 && (key == actions[i]->key
 		  || key == CTRL_(actions[i]->ctrl_key))) {
+			// Count any I/O against the action, if we are
+			// collecting I/O statistics.
+			old_op = vfsetoperation(actions[i]->description);
 			actions[i]->callback();
+			vfsetoperation(old_op);
 			return;
 		}
 	}
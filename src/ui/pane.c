@@ -12,6 +12,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <poll.h>
 
 #include "common.h"
 #include "ui/actions_bar.h"
@@ -185,6 +186,32 @@ void UI_InputKeypress(int key)
 	UI_StackKeypress(UI_ActiveStack(), key);
 }
 
+// While waiting for a keypress, how often to check the watched descriptor.
+#define WATCH_INTERVAL_MS 250
+
+static int main_loop_depth = 0;
+static int watch_fd = -1;
+static void (*watch_callback)(void);
+
+void UI_SetWatchDescriptor(int fd, void (*callback)(void))
+{
+	watch_fd = fd;
+	watch_callback = callback;
+}
+
+static bool CheckWatchDescriptor(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = watch_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0) {
+		return false;
+	}
+	watch_callback();
+	return true;
+}
+
 static bool HandleKeypress(void)
 {
 	int key;
@@ -202,9 +229,20 @@ static bool HandleKeypress(void)
 
 static void HandleKeypresses(void)
 {
-	// Block on the first keypress.
-	nodelay(stdscr, 0);
-	HandleKeypress();
+	// Block on the first keypress. If there is a descriptor to watch,
+	// we wake up periodically to check it, but only in the outermost
+	// main loop, so that nothing changes underneath a dialog box.
+	if (watch_fd >= 0 && main_loop_depth == 1) {
+		timeout(WATCH_INTERVAL_MS);
+		while (!HandleKeypress()) {
+			if (CheckWatchDescriptor()) {
+				return;
+			}
+		}
+	} else {
+		nodelay(stdscr, 0);
+		HandleKeypress();
+	}
 
 	// We now need to do at least one screen update. But read any
 	// additional keypresses first.
@@ -218,12 +256,14 @@ static void HandleKeypresses(void)
 
 void UI_RunMainLoop(void)
 {
+	++main_loop_depth;
 	while (!main_loop_exited) {
 		UI_DrawAllPanes();
 		HandleKeypresses();
 	}
 
 	main_loop_exited = false;
+	--main_loop_depth;
 }
 
 void UI_ExitMainLoop(void)
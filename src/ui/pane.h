@@ -31,6 +31,9 @@ void UI_PaneKeypress(void *pane, int key);
 void UI_StackKeypress(struct pane_stack *s, int key);
 void UI_InputKeypress(int key);
 void UI_RunMainLoop(void);
+// While the main loop is waiting for a keypress, the callback is invoked
+// whenever the given descriptor becomes readable, and the screen redrawn.
+void UI_SetWatchDescriptor(int fd, void (*callback)(void));
 void UI_ExitMainLoop(void);
 void UI_Init(void);
 
@@ -474,7 +474,7 @@ static bool TempMaybeImport(struct temp_edit_context *ctx)
 
 	ClearConversionErrors();
 
-	if (!ImportFromFile(from_file, ctx->filename, ctx->from,
+	if (!ImportFromFile(from_file, ctx->filename, -1, ctx->from,
 	                    ctx->lumpnum, true)) {
 		return !UI_ConfirmDialogBox(
 			"Error", "Edit", "Abort", "Import failed. "
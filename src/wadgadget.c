@@ -8,7 +8,11 @@
 // of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
 //
 
+#include <ctype.h>
 #include <curses.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
@@ -18,6 +22,8 @@
 #include "common.h"
 #include "browser/browser.h"
 #include "fs/vfile.h"  // IWYU pragma: keep
+#include "fs/vfs.h"
+#include "fs/wad_file.h"
 #include "sixel_display.h"
 #include "termfuncs.h"
 #include "ui/pane.h"
@@ -82,6 +88,102 @@ static void SetSigintHandler(void)
 	sigaction(SIGINT, &sa, NULL);
 }
 
+// Parses a positive number at *s and advances *s past it.
+static bool ParsePositive(const char **s, unsigned int *result)
+{
+	unsigned long n;
+	char *end;
+
+	// strtoul() would skip whitespace and accept a sign.
+	if (!isdigit((unsigned char) **s)) {
+		return false;
+	}
+	errno = 0;
+	n = strtoul(*s, &end, 10);
+	if (errno != 0 || n == 0 || n > UINT_MAX) {
+		return false;
+	}
+	*result = n;
+	*s = end;
+	return true;
+}
+
+// WADGADGET_SYNC controls how often changes to WAD files are synced to
+// disk: "commit" (the default), "close", or "periodic[:commits[:secs]]".
+// Syncing less often is much faster on slow or networked storage, at the
+// cost of losing recent changes if we crash.
+static void SetSyncMode(void)
+{
+	const char *mode = getenv("WADGADGET_SYNC"), *p;
+	unsigned int commits = 16, secs = 10;
+
+	if (mode == NULL || !strcmp(mode, "commit")) {
+		return;
+	} else if (!strcmp(mode, "close")) {
+		W_SetDefaultSyncMode(WAD_SYNC_ON_CLOSE, 0, 0);
+		return;
+	} else if (!strncmp(mode, "periodic", 8)) {
+		p = mode + 8;
+		if (*p == ':') {
+			++p;
+			if (!ParsePositive(&p, &commits)) {
+				goto invalid;
+			}
+		}
+		if (*p == ':') {
+			++p;
+			if (!ParsePositive(&p, &secs)) {
+				goto invalid;
+			}
+		}
+		if (*p == '\0') {
+			W_SetDefaultSyncMode(WAD_SYNC_PERIODIC, commits, secs);
+			return;
+		}
+	}
+
+invalid:
+	fprintf(stderr, "Ignoring invalid WADGADGET_SYNC=%s\n", mode);
+}
+
+// WADGADGET_HISTORY_MB limits how much memory the undo history can use
+// before old revisions are moved out to a temporary file.
+static void SetHistoryCap(void)
+{
+	const char *cap = getenv("WADGADGET_HISTORY_MB");
+	unsigned long mb;
+	char *end;
+
+	if (cap == NULL) {
+		return;
+	}
+	errno = 0;
+	mb = strtoul(cap, &end, 10);
+	if (strchr(cap, '-') != NULL || end == cap || *end != '\0'
+	 || errno != 0 || mb > SIZE_MAX / MB(1)) {
+		fprintf(stderr, "Ignoring invalid WADGADGET_HISTORY_MB=%s\n",
+		        cap);
+		return;
+	}
+	VFS_SetHistoryMemoryCap(MB(mb));
+}
+
+// WADGADGET_IOSTATS names a file to log I/O statistics to: the calls made
+// on each file when it is closed, and totals for each action at exit.
+static void SetIOStats(void)
+{
+	const char *path = getenv("WADGADGET_IOSTATS");
+	FILE *log;
+
+	if (path == NULL) {
+		return;
+	}
+	log = fopen(path, "w");
+	if (log != NULL) {
+		vfenableiostats(log);
+	}
+}
+
 #ifdef __APPLE__
 static char *NextLine(char **buf, size_t *buf_len)
 {
@@ -148,6 +250,9 @@ int main(int argc, char *argv[])
 #endif
 
 	SIXEL_CheckSupported();
+	SetIOStats();
+	SetSyncMode();
+	SetHistoryCap();
 
 	if (argc == 2 && !strcmp(argv[1], "--version")) {
 		printf(VERSION_OUTPUT);